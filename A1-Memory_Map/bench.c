@@ -0,0 +1,199 @@
+/* Benchmark for the memchunk scan backends.
+ *
+ * Builds a synthetic address space of many small mappings with mixed
+ * protections, PROT_NONE guard pages and gaps of various sizes, then
+ * times each backend over that range. Each result is checked against
+ * /proc/self/maps.
+ *
+ * -n N sets the number of mappings (default 2000), -d secs the time
+ * spent on each backend (default 0.5), and -t N the thread count for
+ * the parallel backends (default one per CPU). -f times scans of the
+ * whole address space instead, leaving out backends that can't skip
+ * free space on a 64-bit build. Only differences inside the synthetic
+ * area count against correctness; outside it, the scans' own heap and
+ * thread arenas change while they run.
+ */
+
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "memchunk.h"
+
+struct backend
+{
+	const char *name;
+	int mode;
+	int exhaustive;		/* visits every page of the range */
+};
+
+static struct backend backends[] = {
+	{ "maps",		MEMCHUNK_MAPS,				0 },
+	{ "probe",		MEMCHUNK_PROBE,				1 },
+	{ "nofault",		MEMCHUNK_NOFAULT,			1 },
+	{ "probe+skip",		MEMCHUNK_PROBE | MEMCHUNK_SKIP,		0 },
+	{ "nofault+skip",	MEMCHUNK_NOFAULT | MEMCHUNK_SKIP,	0 },
+	{ "nofault+threads",	MEMCHUNK_NOFAULT | MEMCHUNK_PARALLEL,	1 },
+	{ "nofault+skip+threads",
+		MEMCHUNK_NOFAULT | MEMCHUNK_SKIP | MEMCHUNK_PARALLEL,	0 },
+};
+
+#define NUM_BACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+static double now();
+static int differences(struct memchunk *ref, int ref_count,
+		       struct memchunk *list, int count,
+		       unsigned long start, unsigned long end);
+static unsigned long build_area(int nmaps, int page_size,
+				unsigned long *area_end);
+
+int main(int argc, char *argv[])
+{
+	struct memchunk *list, *ref;
+	unsigned long area, area_end, start, end, faults;
+	double secs = 0.5, t0, elapsed;
+	int nmaps = 2000, nthreads = 0, full = 0;
+	int count, ref_count, scans, correct, mode, ch;
+	unsigned int i;
+
+	while ((ch = getopt(argc, argv, "d:fn:t:")) != -1) {
+		if (ch == 'd') {
+			secs = atof(optarg);
+		} else if (ch == 'f') {
+			full = 1;
+		} else if (ch == 'n') {
+			nmaps = atoi(optarg);
+		} else if (ch == 't') {
+			nthreads = atoi(optarg);
+		} else {
+			fprintf(stderr, "usage: %s [-f] [-d secs] [-n maps] "
+				"[-t threads]\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	area = build_area(nmaps, getpagesize(), &area_end);
+	start = full ? 0 : area;
+	end = full ? 0 : area_end;
+	printf("%d mappings, range %lX-%lX\n\n", nmaps, start, end);
+	printf("%-22s %10s %10s %12s %7s %s\n", "backend", "scans/s",
+	       "ms/scan", "faults/scan", "chunks", "correct");
+
+	for (i = 0; i < NUM_BACKENDS; i++) {
+		if (full && backends[i].exhaustive &&
+		    MEMCHUNK_ADDR_MAX > 0xFFFFFFFFUL)
+			continue;
+		mode = backends[i].mode;
+		if (mode & MEMCHUNK_PARALLEL)
+			mode |= MEMCHUNK_THREADS(nthreads);
+
+		/* one untimed scan, so later ones don't see its heap grow */
+		free(get_mem_layout_alloc(mode, start, end, &count));
+
+		faults = get_mem_layout_faults();
+		scans = 0;
+		t0 = now();
+		do {
+			list = get_mem_layout_alloc(mode, start, end, &count);
+			scans++;
+			elapsed = now() - t0;
+			if (elapsed < secs)
+				free(list);
+		} while (elapsed < secs);
+		faults = get_mem_layout_faults() - faults;
+
+		ref = get_mem_layout_alloc(MEMCHUNK_MAPS, start, end,
+					   &ref_count);
+		correct = list != NULL && ref != NULL &&
+			differences(ref, ref_count, list, count,
+				    area, area_end) == 0;
+		printf("%-22s %10.1f %10.3f %12.1f %7d %s\n",
+		       backends[i].name, scans / elapsed,
+		       elapsed * 1000 / scans, (double) faults / scans,
+		       count, correct ? "yes" : "NO");
+		free(list);
+		free(ref);
+	}
+	return 0;
+}
+
+static double now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Number of ranges in [start, end) that two layouts disagree on. */
+static int differences(struct memchunk *ref, int ref_count,
+		       struct memchunk *list, int count,
+		       unsigned long start, unsigned long end)
+{
+	struct memchunk_delta *deltas;
+	int i, n, in_area = 0;
+
+	n = memchunk_diff(ref, ref_count, list, count, NULL, 0);
+	deltas = malloc(n * sizeof(*deltas) + 1);
+	if (deltas == NULL)
+		return n;
+	memchunk_diff(ref, ref_count, list, count, deltas, n);
+	for (i = 0; i < n; i++) {
+		unsigned long d_start = (unsigned long) deltas[i].start;
+
+		if (d_start < end && d_start + deltas[i].length > start)
+			in_area++;
+	}
+	free(deltas);
+	return in_area;
+}
+
+/* Lay out nmaps mappings of 1-4 pages in a reserved area: mostly
+ * read-write or read-only, some PROT_NONE guards, separated by no gap,
+ * a few pages, or now and then a megabyte. Returns the start of the
+ * area and its end in *area_end.
+ */
+static unsigned long build_area(int nmaps, int page_size,
+				unsigned long *area_end)
+{
+	static const int prots[] = {
+		PROT_READ | PROT_WRITE, PROT_READ | PROT_WRITE, PROT_READ,
+		PROT_NONE
+	};
+	unsigned long size = (unsigned long) nmaps * 8 * page_size +
+		(nmaps / 64 + 1) * (1UL << 20);
+	unsigned long pos, pages;
+	char *area;
+	void *p;
+	int i;
+
+	/* reserve, then free, to find a hole big enough */
+	area = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS |
+		    MAP_NORESERVE, -1, 0);
+	if (area == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	munmap(area, size);
+
+	srand(1);
+	pos = (unsigned long) area;
+	for (i = 0; i < nmaps; i++) {
+		pages = 1 + rand() % 4;
+		p = mmap((void *) pos, pages * page_size,
+			 prots[rand() % 4], MAP_PRIVATE | MAP_ANONYMOUS |
+			 MAP_FIXED, -1, 0);
+		if (p == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
+		}
+		pos += pages * page_size;
+		if (rand() % 64 == 0)
+			pos += 1UL << 20;
+		else
+			pos += (rand() % 4) * page_size;
+	}
+	*area_end = pos;
+	return (unsigned long) area;
+}
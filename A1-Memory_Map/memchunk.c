@@ -1,5 +1,12 @@
+#define _GNU_SOURCE
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -8,57 +15,1664 @@
 #define RET_MAPERR 1
 #define RET_ACCERR 2
 
-static sigjmp_buf jmpbuf;
+/* Last address covered by a scan */
+#define SCAN_END MEMCHUNK_ADDR_MAX
 
+/* Mappings a prober holds without allocating */
+#define PROBER_REGIONS 256
+
+/* Chunks collected so far by one scan */
+struct layout
+{
+	struct memchunk *list;
+	int size;
+	int count;		/* chunks found, may exceed size */
+	int grow;		/* realloc list rather than drop chunks */
+	unsigned long end;	/* where layout_end closes the last chunk */
+	memchunk_cb cb;		/* if set, chunks go here instead of list */
+	void *arg;
+	int pending;		/* last has not been passed to cb yet */
+	int stop;		/* cb asked for the scan to end */
+	pid_t pid;		/* process scanned, 0 for this one */
+	int error;		/* errno that ended the scan, or 0 */
+	struct memchunk chunk;	/* chunk currently being extended */
+	struct memchunk last;	/* most recently stored chunk */
+};
+
+/* One line of /proc/<pid>/maps, for probing another process */
+struct region
+{
+	unsigned long start;
+	unsigned long end;
+	int readable;
+	int writable;
+};
+
+/* How a probing scan classifies single pages */
+struct prober
+{
+	int mode;		/* MEMCHUNK_PROBE or MEMCHUNK_NOFAULT */
+	int page_size;
+	int pipefd[2];		/* scratch pipe for MEMCHUNK_NOFAULT */
+	pid_t pid;		/* another process to probe, or 0 */
+	struct region *regions;	/* for NOFAULT or another process, the
+				   mappings in address order */
+	int nregions;
+	int regions_size;
+	/* where regions starts out, so a scan of a process with few
+	   mappings doesn't create the heap it is describing */
+	struct region inline_regions[PROBER_REGIONS];
+	int error;		/* errno that makes probing pointless */
+};
+
+/* Where maps_line adds the lines maps_read gives it */
+struct maps_scan
+{
+	struct layout *l;
+	unsigned long first;
+	unsigned long last;
+};
+
+/* State of get_mem_layout_ext while it reads the maps file */
+struct ext_scan
+{
+	struct memchunk_ext *list;
+	int size;
+	int count;
+	pid_t pid;
+	int page_size;
+	int pagemap_fd;		/* /proc/<pid>/pagemap for other processes */
+	unsigned long pos;	/* end of the last line seen */
+	struct memchunk_ext chunk;	/* chunk being extended */
+};
+
+/* Where export_heatmap writes the regions maps_read gives it */
+struct heat_scan
+{
+	FILE *out;
+	int page_size;
+	int pagemap_fd;
+	int kpageflags_fd;	/* -1 without permission */
+};
+
+/* Work shared by the threads of a parallel scan */
+struct scan_job
+{
+	int mode;
+	pid_t pid;
+	int npieces;
+	unsigned long first;
+	unsigned long last;
+	unsigned long piece_size;
+	int next;			/* next piece to hand out */
+	struct layout *pieces;		/* one result per piece */
+};
+
+/* Finer than one piece per thread so uneven pieces balance out */
+#define PIECES_PER_THREAD 16
+
+#define PROBE_BACKEND(mode) (((mode) & MEMCHUNK_BACKEND) == MEMCHUNK_NOFAULT \
+			     ? MEMCHUNK_NOFAULT : MEMCHUNK_PROBE)
+
+/* Per thread, so parallel scans each recover from their own faults */
+static __thread sigjmp_buf jmpbuf;
+
+/* Faults taken by MEMCHUNK_PROBE scans, for benchmarking */
+static unsigned long fault_count;
+
+/* Bumped by memchunk_changed to invalidate every index */
+static unsigned long generation;
+
+static int scan_range(struct layout *l, int mode, unsigned long start,
+		      unsigned long end);
+static void run_scan(struct layout *l, int mode, unsigned long first,
+		     unsigned long last);
+static void probe_layout(struct layout *l, int mode, unsigned long first,
+			 unsigned long last);
+static void probe_range(struct layout *l, struct prober *p, int skip,
+			unsigned long first, unsigned long last);
+static int parallel_layout(struct layout *l, int mode, unsigned long first,
+			   unsigned long last);
+static void *scan_worker(void *arg);
+static int chunk_unchanged(struct prober *p, const struct memchunk *c);
+static int diff_class(const struct memchunk *list, int count, int *i,
+		      unsigned long pos, unsigned long *end);
+static void skip_range(struct layout *l, struct prober *p,
+		       unsigned long start, unsigned long last);
+static int range_mapped(unsigned long start, unsigned long length);
+static int range_unmapped(unsigned long start, unsigned long length);
+static int prober_mapped(struct prober *p, unsigned long start,
+			 unsigned long length);
+static int prober_unmapped(struct prober *p, unsigned long start,
+			   unsigned long length);
+static int region_line(char *line, void *arg);
+static struct region *region_find(struct prober *p, unsigned long address);
+static void prober_open(struct prober *p, int mode, pid_t pid);
+static void prober_close(struct prober *p);
+static int prober_access(struct prober *p, unsigned long address);
+static int nofault_page_access(struct prober *p, unsigned long address);
+static int remote_page_access(struct prober *p, unsigned long address);
+static int maps_layout(struct layout *l, unsigned long first,
+		       unsigned long last);
+static void check_layout(struct layout *l, int probe_mode,
+			 unsigned long first, unsigned long last);
+static int maps_read(pid_t pid, int (*fn)(char *line, void *arg),
+		     void *arg);
+static int maps_line(char *line, void *arg);
+static int ext_line(char *line, void *arg);
+static void ext_add(struct ext_scan *e, const struct memchunk_ext *c);
+static void ext_store(struct ext_scan *e);
+static void ext_residency(struct ext_scan *e, struct memchunk_ext *c);
+static int index_check(struct memchunk_index *index);
+static int index_build(struct memchunk_index *index);
+static unsigned long index_statm(struct memchunk_index *index);
+static int index_search(struct memchunk_index *index, unsigned long address);
+static int heat_line(char *line, void *arg);
+static int heat_page(struct heat_scan *h, unsigned long long entry);
+static void heat_string(FILE *out, const char *str);
+static int report_diff(const struct layout *a, const struct layout *b);
+static void layout_init(struct layout *l, struct memchunk *list, int size,
+			unsigned long end);
+static void layout_begin(struct layout *l, unsigned long start, int RW);
+static void layout_mark(struct layout *l, unsigned long address, int RW);
+static void layout_end(struct layout *l, unsigned long last);
+static void layout_emit(struct layout *l);
+static void layout_store(struct layout *l);
 static int get_page_access(unsigned long address);
 static void setup_signal_handler();
 static void segfault_sigaction(int signal, siginfo_t *si, void *arg);
 
 int get_mem_layout(struct memchunk *chunk_list, int size)
 {
-	struct memchunk chunk;
-	int chunk_num = 0;
-	unsigned long mem_position = 0;
-	int page_size = 0;
-	int block_accessible;
-
-	page_size = getpagesize();
-	setup_signal_handler();
-
-	/* Initialize the first chunk */
-	chunk.start = (void *) 0;
-	chunk.length = 0;
- 	chunk.RW = get_page_access(0);
-	mem_position += page_size;
-
-	while (mem_position <= 0xFFFFFFFF)
-	{
-		block_accessible = get_page_access(mem_position);
-
-		if (block_accessible != chunk.RW) {
-			/* Accessibility status changed. Save previous chunk. */
-			chunk.length = mem_position -
-				(unsigned long) chunk.start;
-			if (chunk_num < size) { /* If array is big enough... */
-				memcpy(&chunk_list[chunk_num],
-				       &chunk, sizeof(chunk));
+	return get_mem_layout_mode(chunk_list, size, MEMCHUNK_DEFAULT);
+}
+
+/* Number of SIGSEGV/SIGBUS faults probing has taken so far. */
+unsigned long get_mem_layout_faults()
+{
+	return __sync_add_and_fetch(&fault_count, 0);
+}
+
+/* Scan the address space with a specific backend. MEMCHUNK_MAPS falls
+ * back to probing when /proc/self/maps cannot be read. Returns -1 with
+ * errno set if the scan can't run, such as MEMCHUNK_NOFAULT without a
+ * file descriptor for its pipe.
+ */
+int get_mem_layout_mode(struct memchunk *chunk_list, int size, int mode)
+{
+	struct layout l;
+
+	/* the last chunk has always stopped one byte short of the end */
+	layout_init(&l, chunk_list, size, SCAN_END);
+	run_scan(&l, mode, 0, SCAN_END);
+	if (l.error) {
+		errno = l.error;
+		return -1;
+	}
+	return l.count;
+}
+
+int get_mem_layout_parallel(struct memchunk *chunk_list, int size, int mode,
+			    int nthreads)
+{
+	return get_mem_layout_mode(chunk_list, size,
+				   mode | MEMCHUNK_THREADS(nthreads));
+}
+
+/* Like get_mem_layout_mode, but only for [start, end). The range is
+ * widened to whole pages, an end of 0 means the top of the address
+ * space, and the last chunk ends exactly at end.
+ */
+int get_mem_layout_range(struct memchunk *chunk_list, int size, int mode,
+			 unsigned long start, unsigned long end)
+{
+	struct layout l;
+
+	layout_init(&l, chunk_list, size, 0);
+	scan_range(&l, mode, start, end);
+	if (l.error) {
+		errno = l.error;
+		return -1;
+	}
+	return l.count;
+}
+
+/* Scan [start, end) into an array that grows as needed. The caller
+ * frees it. Returns NULL, with *count set to -1, if memory runs out.
+ */
+struct memchunk *get_mem_layout_alloc(int mode, unsigned long start,
+				      unsigned long end, int *count)
+{
+	return get_mem_layout_pid_alloc(0, mode, start, end, count);
+}
+
+/* Scan [start, end), calling cb with each chunk as soon as it is known.
+ * A nonzero return from cb stops the scan. Returns the number of chunks
+ * passed to cb, or -1 with errno set if the scan failed.
+ */
+int scan_mem_layout(int mode, unsigned long start, unsigned long end,
+		    memchunk_cb cb, void *arg)
+{
+	struct layout l;
+
+	layout_init(&l, NULL, 0, 0);
+	l.cb = cb;
+	l.arg = arg;
+	scan_range(&l, mode, start, end);
+	if (l.error) {
+		errno = l.error;
+		return -1;
+	}
+	return l.count;
+}
+
+/* Compare two layouts and store the ranges that changed between them in
+ * deltas, merging neighbouring ranges that changed the same way.
+ * Addresses a list doesn't cover count as unmapped. Returns the number
+ * of deltas, which may be more than size.
+ */
+int memchunk_diff(const struct memchunk *old_list, int old_count,
+		  const struct memchunk *new_list, int new_count,
+		  struct memchunk_delta *deltas, int size)
+{
+	struct memchunk_delta cur;
+	unsigned long pos, a_end, b_end, end;
+	int i = 0, j = 0, n = 0, a, b;
+
+	if (old_count == 0 && new_count == 0)
+		return 0;
+	if (old_count == 0)
+		pos = (unsigned long) new_list[0].start;
+	else if (new_count == 0 || old_list[0].start < new_list[0].start)
+		pos = (unsigned long) old_list[0].start;
+	else
+		pos = (unsigned long) new_list[0].start;
+
+	cur.length = 0;
+	for (;;) {
+		a = diff_class(old_list, old_count, &i, pos, &a_end);
+		b = diff_class(new_list, new_count, &j, pos, &b_end);
+		if (i == old_count && j == new_count)
+			break;
+		end = a_end < b_end ? a_end : b_end;
+		if (a != b) {
+			if (cur.length != 0 && cur.old_RW == a && cur.RW == b &&
+			    (unsigned long) cur.start + cur.length == pos) {
+				cur.length += end - pos;
+			} else {
+				if (cur.length != 0 && n++ < size)
+					deltas[n - 1] = cur;
+				cur.start = (void *) pos;
+				cur.length = end - pos;
+				cur.old_RW = a;
+				cur.RW = b;
+				cur.type = a == -1 ? MEMCHUNK_ADDED :
+					b == -1 ? MEMCHUNK_REMOVED :
+					MEMCHUNK_CHANGED;
 			}
-			chunk_num++;
-			/* Prepare next chunk */
-			chunk.length = 0;
-			chunk.RW = block_accessible;
-			chunk.start = (void *) mem_position;
 		}
-		/* Break if we overflow. */
-		if (mem_position + page_size < mem_position) break;
-		mem_position += page_size;
+		pos = end;
+	}
+	if (cur.length != 0 && n++ < size)
+		deltas[n - 1] = cur;
+	return n;
+}
+
+/* Classification of pos in a sorted list, and where it next changes.
+ * *i is the sweep position in the list and only moves forward.
+ */
+static int diff_class(const struct memchunk *list, int count, int *i,
+		      unsigned long pos, unsigned long *end)
+{
+	while (*i < count &&
+	       (unsigned long) list[*i].start + list[*i].length <= pos)
+		(*i)++;
+	if (*i == count) {
+		*end = ULONG_MAX;
+		return -1;
+	}
+	if ((unsigned long) list[*i].start > pos) {
+		*end = (unsigned long) list[*i].start;
+		return -1;
+	}
+	*end = (unsigned long) list[*i].start + list[*i].length;
+	return list[*i].RW;
+}
+
+/* Scan the whole address space of process pid like get_mem_layout_mode.
+ * MEMCHUNK_MAPS reads /proc/<pid>/maps. The probing backends take the
+ * mappings and their writability from the same file and only read one
+ * byte of each readable page with process_vm_readv; nothing is written
+ * to the process. Without MEMCHUNK_SKIP they visit every page, so on a
+ * 64-bit build they are only practical over a range. No ptrace attach
+ * is needed, but the same permission is. Returns -1 with errno set if
+ * the process can't be inspected.
+ */
+int get_mem_layout_pid(pid_t pid, struct memchunk *chunk_list, int size,
+		       int mode)
+{
+	struct layout l;
+
+	layout_init(&l, chunk_list, size, SCAN_END);
+	l.pid = pid;
+	run_scan(&l, mode, 0, SCAN_END);
+	if (l.error) {
+		errno = l.error;
+		return -1;
+	}
+	return l.count;
+}
+
+/* get_mem_layout_alloc for process pid. Returns NULL with errno set if
+ * the process can't be inspected.
+ */
+struct memchunk *get_mem_layout_pid_alloc(pid_t pid, int mode,
+					  unsigned long start,
+					  unsigned long end, int *count)
+{
+	struct layout l;
+
+	layout_init(&l, NULL, 0, 0);
+	l.grow = 1;
+	l.pid = pid;
+	*count = scan_range(&l, mode, start, end);
+	if (l.error) {
+		free(l.list);
+		errno = l.error;
+		*count = -1;
+		return NULL;
+	}
+	if (l.count > l.size) {
+		free(l.list);
+		*count = -1;
+		return NULL;
+	}
+	if (l.list == NULL)
+		l.list = malloc(sizeof(struct memchunk));
+	return l.list;
+}
+
+/* Rescan the range covered by an earlier result, prev, into a new list
+ * that the caller frees. Rather than visiting every page again, each
+ * previous chunk is checked: an unmapped chunk must still be entirely
+ * free, and a mapped one entirely mapped with its first and last pages
+ * still classified the same. Only chunks that fail are scanned again,
+ * with MEMCHUNK_SKIP. A protection change strictly inside a mapped
+ * chunk is not seen. The MEMCHUNK_MAPS and MEMCHUNK_CHECK backends have
+ * nothing to save and just rescan. Returns NULL, with *count set to -1,
+ * if memory runs out or the scan fails, and then errno says why.
+ */
+struct memchunk *update_mem_layout(const struct memchunk *prev,
+				   int prev_count, int mode, int *count)
+{
+	struct layout l;
+	struct prober p;
+	unsigned long first, end, pos, start;
+	int i;
+
+	if (prev_count == 0)
+		return get_mem_layout_alloc(mode, 0, 0, count);
+	first = (unsigned long) prev[0].start;
+	end = (unsigned long) prev[prev_count - 1].start +
+		prev[prev_count - 1].length;
+
+	layout_init(&l, NULL, 0, end);
+	l.grow = 1;
+	switch (mode & MEMCHUNK_BACKEND) {
+	case MEMCHUNK_MAPS:
+	case MEMCHUNK_CHECK:
+		run_scan(&l, mode, first, end - 1);
+		break;
+	default:
+		prober_open(&p, PROBE_BACKEND(mode), 0);
+		if (p.error) {
+			l.error = p.error;
+			prober_close(&p);
+			break;
+		}
+		layout_begin(&l, first, -1);
+		pos = first;
+		for (i = 0; i < prev_count; i++) {
+			start = (unsigned long) prev[i].start;
+			if (prev[i].length == 0)
+				continue;
+			if (start > pos)	/* not in prev, scan it */
+				skip_range(&l, &p, pos, start - 1);
+			if (chunk_unchanged(&p, &prev[i]))
+				layout_mark(&l, start, prev[i].RW);
+			else
+				skip_range(&l, &p, start,
+					   start + prev[i].length - 1);
+			pos = start + prev[i].length;
+		}
+		layout_end(&l, end);
+		prober_close(&p);
+		break;
+	}
+
+	if (l.error) {
+		free(l.list);
+		errno = l.error;
+		*count = -1;
+		return NULL;
+	}
+	*count = l.count;
+	if (l.count > l.size) {
+		free(l.list);
+		*count = -1;
+		return NULL;
+	}
+	if (l.list == NULL)
+		l.list = malloc(sizeof(struct memchunk));
+	return l.list;
+}
+
+/* Cheap check that a chunk from an earlier scan still looks the same. */
+static int chunk_unchanged(struct prober *p, const struct memchunk *c)
+{
+	unsigned long start = (unsigned long) c->start;
+	unsigned long last_page = (start + c->length - 1) &
+		~((unsigned long) p->page_size - 1);
+
+	if (c->RW == -1)
+		return range_unmapped(start, c->length);
+	return range_mapped(start, c->length) &&
+		prober_access(p, start) == c->RW &&
+		prober_access(p, last_page) == c->RW;
+}
+
+/* Page-align [start, end) and scan it. */
+static int scan_range(struct layout *l, int mode, unsigned long start,
+		      unsigned long end)
+{
+	unsigned long page_mask = ~((unsigned long) getpagesize() - 1);
+	unsigned long first, last;
+
+	first = start & page_mask;
+	last = end == 0 ? SCAN_END : ((end - 1) | ~page_mask);
+	if (last > SCAN_END)
+		last = SCAN_END;
+	if (first > last)
+		return 0;
+	/* a chunk reaching the very top can't have its length stored */
+	l->end = last + 1 == 0 ? last : last + 1;
+	run_scan(l, mode, first, last);
+	return l->count;
+}
+
+/* Dispatch to the backend selected by mode. */
+static void run_scan(struct layout *l, int mode, unsigned long first,
+		     unsigned long last)
+{
+	int probe_mode = MEMCHUNK_PROBE | (mode & ~MEMCHUNK_BACKEND);
+
+	switch (mode & MEMCHUNK_BACKEND) {
+	case MEMCHUNK_CHECK:
+		check_layout(l, probe_mode, first, last);
+		return;
+	case MEMCHUNK_MAPS:
+		if (maps_layout(l, first, last) == 0)
+			return;
+		if (l->pid != 0) {
+			/* probing isn't a stand-in for another process */
+			l->error = errno;
+			return;
+		}
+		mode = probe_mode;
+		break;
+	}
+	if ((mode & MEMCHUNK_PARALLEL) &&
+	    parallel_layout(l, mode, first, last) == 0)
+		return;
+	probe_layout(l, mode, first, last);
+}
+
+/* Classify every page, by touching it or through the kernel. With
+ * MEMCHUNK_SKIP, whole blocks are first tested for being entirely
+ * mapped or entirely free and only split when they are neither.
+ */
+static void probe_layout(struct layout *l, int mode, unsigned long first,
+			 unsigned long last)
+{
+	struct prober p;
+
+	prober_open(&p, PROBE_BACKEND(mode), l->pid);
+	if (p.error) {
+		l->error = p.error;
+		prober_close(&p);
+		return;
+	}
+	layout_begin(l, first, -1);
+	probe_range(l, &p, mode & MEMCHUNK_SKIP, first, last);
+	layout_end(l, l->end);
+	prober_close(&p);
+}
+
+/* Add the page-aligned range [first, last] to a layout. */
+static void probe_range(struct layout *l, struct prober *p, int skip,
+			unsigned long first, unsigned long last)
+{
+	unsigned long mem_position;
+
+	if (skip) {
+		skip_range(l, p, first, last);
+		return;
+	}
+	for (mem_position = first; !l->stop; mem_position += p->page_size) {
+		layout_mark(l, mem_position, prober_access(p, mem_position));
+		if (p->error) {
+			l->error = p->error;
+			l->stop = 1;
+		}
+		/* Break at the end, before we can overflow. */
+		if (last - mem_position < p->page_size) break;
+	}
+}
+
+/* Scan with several threads, each taking pieces of the range off a
+ * shared counter. Pieces are scanned into their own layouts and then
+ * replayed in address order, which merges chunks that span piece
+ * boundaries, so the result is identical to a serial scan. Returns -1
+ * if it couldn't get the memory to run.
+ */
+static int parallel_layout(struct layout *l, int mode, unsigned long first,
+			   unsigned long last)
+{
+	struct scan_job job;
+	pthread_t *threads;
+	int nthreads = (mode >> 16) & 0xff;
+	int started = 0;
+	int failed = 0;
+	int i, k;
+
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+
+	memset(&job, 0, sizeof(job));
+	job.mode = mode;
+	job.pid = l->pid;
+	job.first = first;
+	job.last = last;
+	job.npieces = nthreads * PIECES_PER_THREAD;
+	job.piece_size = ((last - first) / job.npieces + 1) &
+		~((unsigned long) getpagesize() - 1);
+	if (job.piece_size == 0) {
+		/* too small to be worth splitting */
+		job.npieces = 1;
+		job.piece_size = last - first + 1;
+	}
+	job.pieces = calloc(job.npieces, sizeof(struct layout));
+	threads = calloc(nthreads, sizeof(pthread_t));
+	if (job.pieces == NULL || threads == NULL) {
+		free(job.pieces);
+		free(threads);
+		return -1;
+	}
+
+	/* the calling thread works too */
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, scan_worker, &job) != 0)
+			break;
+		started++;
+	}
+	scan_worker(&job);
+	for (i = 1; i <= started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	for (i = 0; i < job.npieces; i++) {
+		if (job.pieces[i].count > job.pieces[i].size)
+			failed = 1;
+		if (job.pieces[i].error)
+			l->error = job.pieces[i].error;
+	}
+	if (!failed) {
+		layout_begin(l, first, -1);
+		for (i = 0; i < job.npieces && !l->stop; i++) {
+			struct layout *piece = &job.pieces[i];
+
+			for (k = 0; k < piece->count; k++)
+				layout_mark(l,
+					    (unsigned long) piece->list[k].start,
+					    piece->list[k].RW);
+		}
+		layout_end(l, l->end);
+	}
+	for (i = 0; i < job.npieces; i++)
+		free(job.pieces[i].list);
+	free(job.pieces);
+	return failed ? -1 : 0;
+}
+
+static void *scan_worker(void *arg)
+{
+	struct scan_job *job = arg;
+	struct prober p;
+	unsigned long first, last;
+	int i;
+
+	prober_open(&p, PROBE_BACKEND(job->mode), job->pid);
+	while ((i = __sync_fetch_and_add(&job->next, 1)) < job->npieces) {
+		struct layout *piece = &job->pieces[i];
+
+		first = job->first + i * job->piece_size;
+		last = i == job->npieces - 1 ? job->last :
+			first + job->piece_size - 1;
+		layout_init(piece, NULL, 0, last);
+		if (p.error) {
+			piece->error = p.error;
+			continue;
+		}
+		piece->grow = 1;
+		layout_begin(piece, first, -1);
+		probe_range(piece, &p, job->mode & MEMCHUNK_SKIP, first, last);
+		/* only the starts are replayed, the length doesn't matter */
+		layout_end(piece, last);
+	}
+	prober_close(&p);
+	return NULL;
+}
+
+/* Classify the page-aligned range [start, last] by halving it until
+ * each piece is known to be fully mapped, fully free, or a single page.
+ * Visiting the halves in order keeps the layout_mark calls ascending,
+ * so the result is the same as visiting every page.
+ */
+static void skip_range(struct layout *l, struct prober *p,
+		       unsigned long start, unsigned long last)
+{
+	unsigned long length = last - start + 1;	/* 0 if it wraps */
+	unsigned long half;
+
+	if (l->stop)
+		return;
+	if (last - start < p->page_size) {
+		layout_mark(l, start, prober_access(p, start));
+		return;
+	}
+	if (length != 0 && prober_mapped(p, start, length)) {
+		/* no gaps to find, classify page by page */
+		probe_range(l, p, 0, start, last);
+		return;
 	}
-	chunk.length = 0xFFFFFFFF - (unsigned long) chunk.start;
-	if (chunk_num < size) { /* If array is big enough... */
-		memcpy(&chunk_list[chunk_num], &chunk, sizeof(chunk));
+	if (length != 0 && prober_unmapped(p, start, length)) {
+		layout_mark(l, start, -1);
+		return;
 	}
+	half = ((last - start) / 2 + 1) & ~((unsigned long) p->page_size - 1);
+	skip_range(l, p, start, start + half - 1);
+	skip_range(l, p, start + half, last);
+}
+
+/* msync fails with ENOMEM if any page in the range is unmapped. */
+static int range_mapped(unsigned long start, unsigned long length)
+{
+	return msync((void *) start, length, MS_ASYNC) == 0;
+}
+
+/* True if nothing at all is mapped in the range. A MAP_FIXED_NOREPLACE
+ * mapping only succeeds over free space; it is removed straight away,
+ * so for that instant the range is reserved and another thread mapping
+ * there with MAP_FIXED_NOREPLACE could fail. Kernels that predate the
+ * flag treat the address as a hint, which just means no skipping.
+ */
+static int range_unmapped(unsigned long start, unsigned long length)
+{
+#ifdef MAP_FIXED_NOREPLACE
+	void *p;
+
+	p = mmap((void *) start, length, PROT_NONE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+		 MAP_FIXED_NOREPLACE, -1, 0);
+	if (p == MAP_FAILED)
+		return 0;
+	munmap(p, length);
+	return p == (void *) start;
+#else
+	return 0;
+#endif
+}
+
+/* range_mapped, for this process or, from its maps, another */
+static int prober_mapped(struct prober *p, unsigned long start,
+			 unsigned long length)
+{
+	unsigned long pos = start;
+	struct region *r;
+
+	if (p->pid == 0)
+		return range_mapped(start, length);
+	/* each region must start where the one before ends */
+	while ((r = region_find(p, pos)) != NULL) {
+		if (r->end == 0 || r->end - start >= length)
+			return 1;
+		pos = r->end;
+	}
+	return 0;
+}
+
+/* range_unmapped, for this process or, from its maps, another */
+static int prober_unmapped(struct prober *p, unsigned long start,
+			   unsigned long length)
+{
+	int lo = 0, hi, mid;
+
+	if (p->pid == 0)
+		return range_unmapped(start, length);
+	/* the first region ending after start must begin past the range */
+	hi = p->nregions;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (p->regions[mid].end != 0 && p->regions[mid].end <= start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo == p->nregions || (p->regions[lo].start > start &&
+				     p->regions[lo].start - start >= length);
+}
 
-	return chunk_num + 1;
+static void prober_open(struct prober *p, int mode, pid_t pid)
+{
+	p->mode = mode;
+	p->page_size = getpagesize();
+	p->pid = pid;
+	p->regions = p->inline_regions;
+	p->nregions = 0;
+	p->regions_size = PROBER_REGIONS;
+	p->pipefd[0] = p->pipefd[1] = -1;
+	p->error = 0;
+	if (pid != 0) {
+		/* either backend probes another process the same way */
+		p->mode = MEMCHUNK_NOFAULT;
+		if (maps_read(pid, region_line, p) == -1 && p->error == 0)
+			p->error = errno;
+		return;
+	}
+	/* no falling back to the signal prober: its handler is for the
+	   whole process, which is what NOFAULT callers are avoiding */
+	if (mode == MEMCHUNK_NOFAULT) {
+		if (pipe(p->pipefd) == -1)
+			p->error = errno;
+		else if (maps_read(0, region_line, p) == -1 && p->error == 0)
+			p->error = errno;
+	}
+	if (p->mode == MEMCHUNK_PROBE)
+		setup_signal_handler();
+}
+
+static void prober_close(struct prober *p)
+{
+	if (p->regions != p->inline_regions)
+		free(p->regions);
+	if (p->pipefd[0] != -1) {
+		close(p->pipefd[0]);
+		close(p->pipefd[1]);
+	}
+}
+
+static int prober_access(struct prober *p, unsigned long address)
+{
+	if (p->error)
+		return -1;
+	if (p->pid != 0)
+		return remote_page_access(p, address);
+	if (p->mode == MEMCHUNK_NOFAULT)
+		return nofault_page_access(p, address);
+	return get_page_access(address);
+}
+
+/* Classify a page without taking a fault.
+ *
+ * mincore fails with ENOMEM for unmapped pages. For mapped ones, the
+ * kernel copies one byte out of the page into a pipe, which fails with
+ * EFAULT rather than raising SIGSEGV if the page can't be read.
+ * Whether it is writable comes from the maps read by prober_open, so
+ * the page is never written: nothing another thread stores is lost and
+ * no page is dirtied or copied.
+ */
+static int nofault_page_access(struct prober *p, unsigned long address)
+{
+	struct region *r;
+	unsigned char vec;
+	char data;
+
+	if (mincore((void *) address, p->page_size, &vec) == -1)
+		return errno == ENOMEM ? -1 : 0;
+	if (write(p->pipefd[1], (void *) address, 1) != 1)
+		return 0;
+	/* empty the pipe for the next page */
+	read(p->pipefd[0], &data, 1);
+	if ((r = region_find(p, address)) == NULL) {
+		/* mapped since the maps were read, so read them again */
+		p->nregions = 0;
+		if (maps_read(0, region_line, p) == -1 && p->error == 0)
+			p->error = errno;
+		r = region_find(p, address);
+	}
+	return r != NULL && r->writable;
+}
+
+/* Classify a page of another process. Whether it is mapped, and
+ * writable, comes from the maps read by prober_open; the target is only
+ * read, never written, so no copy-on-write or dirtying is caused. The
+ * one byte read with process_vm_readv (EFAULT rather than a fault if it
+ * can't be) notices the process going away or being off limits.
+ */
+static int remote_page_access(struct prober *p, unsigned long address)
+{
+	struct iovec local, remote;
+	struct region *r;
+	char data;
+
+	if ((r = region_find(p, address)) == NULL)
+		return -1;
+	if (!r->readable)
+		return r->writable;
+	local.iov_base = &data;
+	local.iov_len = 1;
+	remote.iov_base = (void *) address;
+	remote.iov_len = 1;
+	if (process_vm_readv(p->pid, &local, 1, &remote, 1, 0) != 1 &&
+	    errno != EFAULT) {
+		/* gone, or not ours to look at */
+		p->error = errno;
+		return -1;
+	}
+	return r->writable;
+}
+
+/* Add one line of /proc/<pid>/maps to a prober's regions. */
+static int region_line(char *line, void *arg)
+{
+	struct prober *p = arg;
+	struct region *r;
+	unsigned long start, end;
+	char perms[5];
+
+	if (sscanf(line, "%lx-%lx %4s", &start, &end, perms) != 3)
+		return 0;
+	if (p->nregions == p->regions_size) {
+		int size = p->regions_size * 2;
+
+		if (p->regions == p->inline_regions) {
+			r = malloc(size * sizeof(struct region));
+			if (r != NULL)
+				memcpy(r, p->regions,
+				       p->nregions * sizeof(struct region));
+		} else {
+			r = realloc(p->regions, size * sizeof(struct region));
+		}
+		if (r == NULL) {
+			p->error = ENOMEM;
+			return 1;
+		}
+		p->regions = r;
+		p->regions_size = size;
+	}
+	r = &p->regions[p->nregions++];
+	r->start = start;
+	r->end = end;
+	r->readable = perms[0] == 'r';
+	r->writable = perms[1] == 'w';
+	return 0;
+}
+
+/* The region holding address, or NULL if it is in none of them. */
+static struct region *region_find(struct prober *p, unsigned long address)
+{
+	int lo = 0, hi = p->nregions, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (address < p->regions[mid].start)
+			hi = mid;
+		else if (p->regions[mid].end != 0 &&
+			 address >= p->regions[mid].end)
+			lo = mid + 1;
+		else
+			return &p->regions[mid];
+	}
+	return NULL;
+}
+
+/* Build the layout from the kernel's list of mappings. Mapped regions
+ * are writable (1) or not (0), the same split the probe makes with
+ * SEGV_ACCERR; adjacent regions with the same class are merged.
+ *
+ * The file is read into a stack buffer so the scan does not allocate
+ * and disturb the heap it is describing. Returns -1 if it can't be read.
+ */
+static int maps_layout(struct layout *l, unsigned long first,
+		       unsigned long last)
+{
+	struct maps_scan m;
+
+	m.l = l;
+	m.first = first;
+	m.last = last;
+	layout_begin(l, first, -1);
+	if (maps_read(l->pid, maps_line, &m) == -1)
+		return -1;
+	layout_end(l, l->end);
+	return 0;
+}
+
+/* Call fn with each line of /proc/<pid>/maps (pid 0 is this process)
+ * until it returns nonzero. Returns -1 if the file can't be read.
+ */
+static int maps_read(pid_t pid, int (*fn)(char *line, void *arg), void *arg)
+{
+	char buf[4096];
+	char *line, *nl;
+	size_t len = 0;
+	ssize_t n;
+	int skip = 0;
+	int stop = 0;
+	int fd;
+
+	if (pid != 0)
+		snprintf(buf, sizeof(buf), "/proc/%d/maps", (int) pid);
+	else
+		strcpy(buf, "/proc/self/maps");
+	if ((fd = open(buf, O_RDONLY)) == -1)
+		return -1;
+
+	while (!stop && (n = read(fd, buf + len, sizeof(buf) - 1 - len)) > 0) {
+		len += n;
+		buf[len] = '\0';
+		line = buf;
+		while (!stop &&
+		       (nl = memchr(line, '\n', buf + len - line)) != NULL) {
+			*nl = '\0';
+			if (!skip)
+				stop = fn(line, arg);
+			skip = 0;
+			line = nl + 1;
+		}
+		len = buf + len - line;
+		if (len == sizeof(buf) - 1) {
+			/* Over-long line (a long path). The fields we need
+			 * are at the front, so use them and drop the rest.
+			 */
+			if (!skip)
+				stop = fn(buf, arg);
+			skip = 1;
+			len = 0;
+		}
+		memmove(buf, line, len);
+	}
+	close(fd);
+	return n == -1 ? -1 : 0;
+}
+
+/* Add the part of one "start-end perms ..." line of /proc/self/maps
+ * that falls inside [first, last] to the layout.
+ */
+static int maps_line(char *line, void *arg)
+{
+	struct maps_scan *m = arg;
+	unsigned long start, end;
+	char perms[5];
+
+	if (sscanf(line, "%lx-%lx %4s", &start, &end, perms) != 3)
+		return 0;
+	if (start > m->last || end - 1 < m->first)
+		return 0;
+	layout_mark(m->l, start < m->first ? m->first : start,
+		    perms[1] == 'w' ? 1 : 0);
+	/* a region running to the end of the range has no end marker */
+	if (end != 0 && end - 1 < m->last)
+		layout_mark(m->l, end, -1);
+	return m->l->stop;
+}
+
+/* Fill chunk_list with chunks carrying the full set of attributes from
+ * /proc/<pid>/maps (pid 0 is this process), unmapped gaps included.
+ * Residency comes from mincore for this process and from the present
+ * bit of /proc/<pid>/pagemap for others; if pagemap can't be read the
+ * counts are left 0. Returns the number of chunks, which may be more
+ * than size, or -1 with errno set.
+ */
+int get_mem_layout_ext(pid_t pid, struct memchunk_ext *chunk_list,
+		       int size, int version)
+{
+	struct ext_scan e;
+	char path[64];
+	unsigned long end = SCAN_END + 1 == 0 ? SCAN_END : SCAN_END + 1;
+
+	if (version != MEMCHUNK_EXT_VERSION) {
+		errno = EINVAL;
+		return -1;
+	}
+	memset(&e, 0, sizeof(e));
+	e.list = chunk_list;
+	e.size = size;
+	e.pid = pid;
+	e.page_size = getpagesize();
+	e.pagemap_fd = -1;
+	if (pid != 0) {
+		snprintf(path, sizeof(path), "/proc/%d/pagemap", (int) pid);
+		e.pagemap_fd = open(path, O_RDONLY);
+	}
+
+	if (maps_read(pid, ext_line, &e) == -1) {
+		if (e.pagemap_fd != -1)
+			close(e.pagemap_fd);
+		return -1;
+	}
+	if (e.pos < end) {
+		struct memchunk_ext gap;
+
+		memset(&gap, 0, sizeof(gap));
+		gap.base.start = (void *) e.pos;
+		gap.base.length = end - e.pos;
+		gap.base.RW = -1;
+		ext_add(&e, &gap);
+	}
+	ext_store(&e);
+	if (e.pagemap_fd != -1)
+		close(e.pagemap_fd);
+	return e.count;
+}
+
+/* Turn one maps line, and the gap before it, into chunks. */
+static int ext_line(char *line, void *arg)
+{
+	struct ext_scan *e = arg;
+	struct memchunk_ext c;
+	unsigned long start, end;
+	char perms[5];
+	char *path;
+	int n = 0;
+
+	memset(&c, 0, sizeof(c));
+	if (sscanf(line, "%lx-%lx %4s %lx %*s %*s %n", &start, &end, perms,
+		   &c.offset, &n) < 4 || n == 0)
+		return 0;
+	if (start > SCAN_END)
+		return 0;
+	if (end - 1 > SCAN_END)
+		end = SCAN_END + 1;
+
+	if (start > e->pos) {
+		struct memchunk_ext gap;
+
+		memset(&gap, 0, sizeof(gap));
+		gap.base.start = (void *) e->pos;
+		gap.base.length = start - e->pos;
+		gap.base.RW = -1;
+		ext_add(e, &gap);
+	}
+
+	c.base.start = (void *) start;
+	c.base.length = end - start;
+	c.base.RW = perms[1] == 'w' ? 1 : 0;
+	if (perms[2] == 'x')
+		c.flags |= MEMCHUNK_EXEC;
+	c.flags |= perms[3] == 's' ? MEMCHUNK_SHARED : MEMCHUNK_PRIVATE;
+	path = line + n;
+	strncpy(c.path, path, sizeof(c.path) - 1);
+	ext_residency(e, &c);
+	ext_add(e, &c);
+	e->pos = end;
+	return 0;
+}
+
+/* Append c to the chunk being built if nothing but the length differs,
+ * otherwise store that chunk and start a new one.
+ */
+static void ext_add(struct ext_scan *e, const struct memchunk_ext *c)
+{
+	struct memchunk_ext *cur = &e->chunk;
+
+	if (cur->base.length != 0 && cur->base.RW == c->base.RW &&
+	    cur->flags == c->flags && strcmp(cur->path, c->path) == 0 &&
+	    (c->path[0] == '\0' || c->offset == cur->offset +
+	     cur->base.length) &&
+	    (unsigned long) cur->base.start + cur->base.length ==
+	    (unsigned long) c->base.start) {
+		cur->base.length += c->base.length;
+		cur->resident += c->resident;
+		cur->nonresident += c->nonresident;
+		return;
+	}
+	ext_store(e);
+	*cur = *c;
+	cur->version = MEMCHUNK_EXT_VERSION;
+}
+
+static void ext_store(struct ext_scan *e)
+{
+	if (e->chunk.base.length == 0)
+		return;
+	if (e->count < e->size)
+		e->list[e->count] = e->chunk;
+	e->count++;
+}
+
+/* Count the resident and non-resident pages of a mapped chunk. */
+static void ext_residency(struct ext_scan *e, struct memchunk_ext *c)
+{
+	unsigned char vec[512];
+	unsigned long long entries[512];
+	unsigned long addr = (unsigned long) c->base.start;
+	unsigned long pages = c->base.length / e->page_size;
+	unsigned long i, n;
+
+	while (pages > 0) {
+		n = pages < 512 ? pages : 512;
+		if (e->pid == 0) {
+			if (mincore((void *) addr, n * e->page_size, vec) == -1)
+				return;
+			for (i = 0; i < n; i++) {
+				if (vec[i] & 1)
+					c->resident++;
+				else
+					c->nonresident++;
+			}
+		} else {
+			/* bit 63 of each 64-bit entry: page present */
+			if (e->pagemap_fd == -1 ||
+			    pread(e->pagemap_fd, entries, n * sizeof(entries[0]),
+				  (addr / e->page_size) * sizeof(entries[0])) !=
+			    (ssize_t) (n * sizeof(entries[0])))
+				return;
+			for (i = 0; i < n; i++) {
+				if (entries[i] >> 63)
+					c->resident++;
+				else
+					c->nonresident++;
+			}
+		}
+		addr += n * e->page_size;
+		pages -= n;
+	}
+}
+
+/* Scan the address space into an index with the given backend.
+ * Returns -1 if the scan fails.
+ */
+int memchunk_index_init(struct memchunk_index *index, int mode)
+{
+	memset(index, 0, sizeof(*index));
+	index->mode = mode;
+	index->statm_fd = open("/proc/self/statm", O_RDONLY);
+	return index_build(index);
+}
+
+void memchunk_index_free(struct memchunk_index *index)
+{
+	free(index->list);
+	index->list = NULL;
+	index->count = 0;
+	if (index->statm_fd != -1)
+		close(index->statm_fd);
+	index->statm_fd = -1;
+}
+
+/* Tell every index that the layout changed in a way the mapped size
+ * won't show, such as an mprotect or a same-sized remap.
+ */
+void memchunk_changed()
+{
+	__sync_fetch_and_add(&generation, 1);
+}
+
+/* The chunk containing address, or NULL if the index can't be
+ * rebuilt.
+ */
+const struct memchunk *memchunk_index_find(struct memchunk_index *index,
+					   const void *address)
+{
+	int i;
+
+	if (index_check(index) == -1)
+		return NULL;
+	i = index_search(index, (unsigned long) address);
+	return i == -1 ? NULL : &index->list[i];
+}
+
+/* Find the chunks overlapping [start, start + length). They are
+ * consecutive; *first is set to the first one and the number of them
+ * is returned, or -1 if the index can't be rebuilt.
+ */
+int memchunk_index_range(struct memchunk_index *index, const void *start,
+			 unsigned long length,
+			 const struct memchunk **first)
+{
+	int i, j;
+
+	if (index_check(index) == -1)
+		return -1;
+	if (length == 0)
+		return 0;
+	i = index_search(index, (unsigned long) start);
+	j = index_search(index, (unsigned long) start + length - 1);
+	if (i == -1 || j == -1)
+		return 0;
+	*first = &index->list[i];
+	return j - i + 1;
+}
+
+/* The least access across [start, start + length): 1 if it is all
+ * writable, 0 if all mapped but some is read-only, -1 if any of it is
+ * unmapped (or the index can't be rebuilt).
+ */
+int memchunk_index_access(struct memchunk_index *index, const void *start,
+			  unsigned long length)
+{
+	const struct memchunk *first;
+	int i, n, RW = 1;
+
+	n = memchunk_index_range(index, start, length, &first);
+	if (n <= 0)
+		return -1;
+	for (i = 0; i < n; i++) {
+		if (first[i].RW < RW)
+			RW = first[i].RW;
+	}
+	return RW;
+}
+
+/* Rebuild the index if it may be out of date. */
+static int index_check(struct memchunk_index *index)
+{
+	if (index->list != NULL && index->generation == generation &&
+	    index->size == index_statm(index))
+		return 0;
+	return index_build(index);
+}
+
+static int index_build(struct memchunk_index *index)
+{
+	struct memchunk *list;
+	int count;
+
+	index->generation = generation;
+	list = get_mem_layout_alloc(index->mode, 0, 0, &count);
+	if (list == NULL)
+		return -1;
+	free(index->list);
+	index->list = list;
+	index->count = count;
+	/* after the allocations above, which can move the heap */
+	index->size = index_statm(index);
+	return 0;
+}
+
+/* Total mapped pages, the first field of /proc/self/statm, or 0 if it
+ * can't be read (which makes the check rely on memchunk_changed alone).
+ */
+static unsigned long index_statm(struct memchunk_index *index)
+{
+	char buf[64];
+	ssize_t n;
+
+	if (index->statm_fd == -1)
+		return 0;
+	n = pread(index->statm_fd, buf, sizeof(buf) - 1, 0);
+	if (n <= 0)
+		return 0;
+	buf[n] = '\0';
+	return strtoul(buf, NULL, 10);
+}
+
+/* Index of the chunk containing address, by binary search. */
+static int index_search(struct memchunk_index *index, unsigned long address)
+{
+	int lo = 0, hi = index->count - 1, mid;
+
+	if (index->count == 0 ||
+	    address < (unsigned long) index->list[0].start)
+		return -1;
+	/* the last chunk whose start is at or below address */
+	while (lo < hi) {
+		mid = lo + (hi - lo + 1) / 2;
+		if ((unsigned long) index->list[mid].start <= address)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	/* past the end of the last chunk */
+	if (address - (unsigned long) index->list[lo].start >=
+	    index->list[lo].length)
+		return -1;
+	return lo;
+}
+
+/* Write the state of every page of every mapped region of process pid
+ * (0 for this one) to the file path, one JSON object per region after
+ * a header line. Each page gets a mask of HEAT_* bits from
+ * /proc/<pid>/pagemap, plus /proc/kpageflags when it can be read (as
+ * root), and the masks are run-length encoded as [mask, pages] pairs.
+ * Returns -1 with errno set on failure.
+ */
+int export_heatmap(pid_t pid, const char *path)
+{
+	struct heat_scan h;
+	char name[64];
+	int ret, saved;
+
+	if (pid != 0)
+		snprintf(name, sizeof(name), "/proc/%d/pagemap", (int) pid);
+	else
+		strcpy(name, "/proc/self/pagemap");
+	if ((h.pagemap_fd = open(name, O_RDONLY)) == -1)
+		return -1;
+	if ((h.out = fopen(path, "w")) == NULL) {
+		saved = errno;
+		close(h.pagemap_fd);
+		errno = saved;
+		return -1;
+	}
+	h.kpageflags_fd = open("/proc/kpageflags", O_RDONLY);
+	h.page_size = getpagesize();
+
+	fprintf(h.out, "{\"format\":\"memchunk-heatmap\",\"version\":1,"
+		"\"page_size\":%d,\"bits\":{\"resident\":%d,\"swapped\":%d,"
+		"\"soft_dirty\":%d,\"dirty\":%d,\"huge\":%d},"
+		"\"kpageflags\":%s}\n", h.page_size, HEAT_RESIDENT,
+		HEAT_SWAPPED, HEAT_SOFT_DIRTY, HEAT_DIRTY, HEAT_HUGE,
+		h.kpageflags_fd == -1 ? "false" : "true");
+	ret = maps_read(pid, heat_line, &h);
+	saved = errno;
+
+	close(h.pagemap_fd);
+	if (h.kpageflags_fd != -1)
+		close(h.kpageflags_fd);
+	if (fclose(h.out) != 0 && ret == 0) {
+		saved = errno;
+		ret = -1;
+	}
+	errno = saved;
+	return ret;
+}
+
+/* Reset the soft-dirty bits of process pid, so the next export shows
+ * only pages written since. Returns -1 with errno set on failure.
+ */
+int clear_soft_dirty(pid_t pid)
+{
+	char name[64];
+	int fd, ret;
+
+	if (pid != 0)
+		snprintf(name, sizeof(name), "/proc/%d/clear_refs", (int) pid);
+	else
+		strcpy(name, "/proc/self/clear_refs");
+	if ((fd = open(name, O_WRONLY)) == -1)
+		return -1;
+	ret = write(fd, "4", 1) == 1 ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+/* Write one region of the heat map. */
+static int heat_line(char *line, void *arg)
+{
+	struct heat_scan *h = arg;
+	unsigned long long entries[512];
+	unsigned long start, end, offset, pages, page, i, n;
+	unsigned long run = 0;
+	char perms[5];
+	int mask, cur = -1;
+	int count = 0;
+
+	if (sscanf(line, "%lx-%lx %4s %lx %*s %*s %n", &start, &end, perms,
+		   &offset, &count) < 4 || count == 0)
+		return 0;
+	if (start > SCAN_END)
+		return 0;
+	pages = (end - start) / h->page_size;
+
+	fprintf(h->out, "{\"start\":\"0x%lx\",\"end\":\"0x%lx\","
+		"\"perms\":\"%s\",\"path\":", start, end, perms);
+	heat_string(h->out, line + count);
+	fprintf(h->out, ",\"pages\":%lu,\"runs\":[", pages);
+
+	count = 0;
+	for (page = 0; page < pages; page += n) {
+		n = pages - page < 512 ? pages - page : 512;
+		if (pread(h->pagemap_fd, entries, n * sizeof(entries[0]),
+			  (start / h->page_size + page) * sizeof(entries[0])) !=
+		    (ssize_t) (n * sizeof(entries[0])))
+			memset(entries, 0, sizeof(entries));
+		for (i = 0; i < n; i++) {
+			mask = heat_page(h, entries[i]);
+			if (mask != cur && run > 0) {
+				fprintf(h->out, "%s[%d,%lu]",
+					count++ ? "," : "", cur, run);
+				run = 0;
+			}
+			cur = mask;
+			run++;
+		}
+	}
+	if (run > 0)
+		fprintf(h->out, "%s[%d,%lu]", count ? "," : "", cur, run);
+	fprintf(h->out, "]}\n");
+	return ferror(h->out);
+}
+
+/* HEAT_* mask for one pagemap entry. */
+static int heat_page(struct heat_scan *h, unsigned long long entry)
+{
+	unsigned long long pfn = entry & ((1ULL << 55) - 1);
+	unsigned long long flags;
+	int mask = 0;
+
+	if (entry >> 63 & 1)
+		mask |= HEAT_RESIDENT;
+	if (entry >> 62 & 1)
+		mask |= HEAT_SWAPPED;
+	if (entry >> 55 & 1)
+		mask |= HEAT_SOFT_DIRTY;
+	/* unprivileged readers see a PFN of 0 */
+	if ((mask & HEAT_RESIDENT) && pfn != 0 && h->kpageflags_fd != -1 &&
+	    pread(h->kpageflags_fd, &flags, sizeof(flags),
+		  pfn * sizeof(flags)) == sizeof(flags)) {
+		if (flags >> 4 & 1)			/* KPF_DIRTY */
+			mask |= HEAT_DIRTY;
+		if ((flags >> 17 & 1) || (flags >> 22 & 1))	/* KPF_HUGE, KPF_THP */
+			mask |= HEAT_HUGE;
+	}
+	return mask;
+}
+
+/* Write str as a JSON string. */
+static void heat_string(FILE *out, const char *str)
+{
+	putc('"', out);
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(out, "\\%c", *str);
+		else if ((unsigned char) *str < 0x20)
+			fprintf(out, "\\u%04x", *str);
+		else
+			putc(*str, out);
+	}
+	putc('"', out);
+}
+
+/* Run both backends and print where they disagree. The caller gets the
+ * /proc/self/maps result. Memory the scans allocate for themselves can
+ * show up as a difference around the heap.
+ */
+static void check_layout(struct layout *l, int probe_mode,
+			 unsigned long first, unsigned long last)
+{
+	struct layout maps, probe;
+	int i, n;
+
+	layout_init(&maps, NULL, 0, l->end);
+	layout_init(&probe, NULL, 0, l->end);
+	maps.grow = 1;
+	probe.grow = 1;
+	maps.pid = l->pid;
+	probe.pid = l->pid;
+
+	if (maps_layout(&maps, first, last) == -1) {
+		if (l->pid != 0) {
+			l->error = errno;
+			return;
+		}
+		fprintf(stderr, "memchunk: /proc/self/maps unavailable, "
+			"probing only\n");
+		probe_layout(l, probe_mode, first, last);
+		return;
+	}
+	probe_layout(&probe, probe_mode, first, last);
+	if (probe.error) {
+		l->error = probe.error;
+		free(maps.list);
+		free(probe.list);
+		return;
+	}
+
+	n = report_diff(&maps, &probe);
+	fprintf(stderr, "memchunk: %d difference%s between maps and probe\n",
+		n, n == 1 ? "" : "s");
+
+	/* hand the maps result back to the caller */
+	layout_begin(l, first, -1);
+	for (i = 0; i < maps.count && i < maps.size && !l->stop; i++)
+		layout_mark(l, (unsigned long) maps.list[i].start,
+			    maps.list[i].RW);
+	layout_end(l, l->end);
+	free(maps.list);
+	free(probe.list);
+}
+
+/* Print every address range two complete layouts classify differently.
+ * Returns the number of such ranges.
+ */
+static int report_diff(const struct layout *a, const struct layout *b)
+{
+	struct memchunk_delta *deltas;
+	int a_count = a->count < a->size ? a->count : a->size;
+	int b_count = b->count < b->size ? b->count : b->size;
+	int i, n;
+
+	n = memchunk_diff(a->list, a_count, b->list, b_count, NULL, 0);
+	deltas = malloc(n * sizeof(struct memchunk_delta) + 1);
+	if (deltas == NULL)
+		return n;
+	memchunk_diff(a->list, a_count, b->list, b_count, deltas, n);
+	for (i = 0; i < n; i++)
+		fprintf(stderr, "memchunk: %lX-%lX maps RW %d, probe RW %d\n",
+			(unsigned long) deltas[i].start,
+			(unsigned long) deltas[i].start + deltas[i].length,
+			deltas[i].old_RW, deltas[i].RW);
+	free(deltas);
+	return n;
+}
+
+/* Set up an empty layout. Chunks go into list, or to cb if one is set
+ * afterwards; end is where the final chunk stops.
+ */
+static void layout_init(struct layout *l, struct memchunk *list, int size,
+			unsigned long end)
+{
+	memset(l, 0, sizeof(*l));
+	l->list = list;
+	l->size = size;
+	l->end = end;
+}
+
+/* Start a layout with one chunk beginning at start. */
+static void layout_begin(struct layout *l, unsigned long start, int RW)
+{
+	l->count = 0;
+	l->pending = 0;
+	l->chunk.start = (void *) start;
+	l->chunk.length = 0;
+	l->chunk.RW = RW;
+}
+
+/* Record that memory from address onwards has accessibility RW. */
+static void layout_mark(struct layout *l, unsigned long address, int RW)
+{
+	if (RW == l->chunk.RW)
+		return;
+	if (address == (unsigned long) l->chunk.start) {
+		/* Nothing was covered yet. Reopen the previous chunk if it
+		 * has the same class, otherwise just reclassify.
+		 */
+		if (l->count > 0 && l->last.RW == RW &&
+		    (l->cb == NULL || l->pending)) {
+			l->count--;
+			l->chunk = l->last;
+			l->pending = 0;
+		} else {
+			l->chunk.RW = RW;
+		}
+		return;
+	}
+	/* Accessibility status changed. Save previous chunk. */
+	l->chunk.length = address - (unsigned long) l->chunk.start;
+	layout_store(l);
+	/* Prepare next chunk */
+	l->chunk.length = 0;
+	l->chunk.RW = RW;
+	l->chunk.start = (void *) address;
+}
+
+/* Close the last chunk at address last. */
+static void layout_end(struct layout *l, unsigned long last)
+{
+	l->chunk.length = last - (unsigned long) l->chunk.start;
+	layout_store(l);
+	if (l->pending)
+		layout_emit(l);
+}
+
+/* Hand the held-back chunk to the callback. */
+static void layout_emit(struct layout *l)
+{
+	l->pending = 0;
+	if (!l->stop && l->cb(&l->last, l->arg) != 0)
+		l->stop = 1;
+}
+
+static void layout_store(struct layout *l)
+{
+	struct memchunk *list;
+
+	if (l->stop)
+		return;
+	if (l->cb != NULL) {
+		/* Streaming. Hold each chunk back until the next one is
+		 * stored, since layout_mark may still reopen it.
+		 */
+		if (l->pending)
+			layout_emit(l);
+		if (l->stop)
+			return;
+		l->last = l->chunk;
+		l->pending = 1;
+		l->count++;
+		return;
+	}
+
+	if (l->count >= l->size && l->grow) {
+		list = realloc(l->list, (l->size ? l->size * 2 : 64) *
+			       sizeof(struct memchunk));
+		if (list == NULL) {
+			/* keep counting, like a fixed array */
+			l->grow = 0;
+		} else {
+			l->list = list;
+			l->size = l->size ? l->size * 2 : 64;
+		}
+	}
+	if (l->count < l->size) { /* If array is big enough... */
+		memcpy(&l->list[l->count], &l->chunk, sizeof(l->chunk));
+	}
+	l->last = l->chunk;
+	l->count++;
 }
 
 /* Check whether the program can access the page of memory at an address. */
@@ -67,6 +1681,8 @@ static int get_page_access(unsigned long address)
 	int segv_return = 0;
 	int block_accessed = 0;
 	int block_accessible = 0;
+	/* volatile, or an optimizing compiler drops the read-back write */
+	volatile char *page = (volatile char *) address;
 	char data = 0;
 
 	/* This is true iff a segfault is hit later and the code jumps back */
@@ -84,8 +1700,8 @@ static int get_page_access(unsigned long address)
 		 * If we just write random data back, we will corrupt the
 		 * program's memory.
 		 */
-		data = ((char *) address)[0];
-		((char *) address)[0] = data;
+		data = page[0];
+		page[0] = data;
 	}
 	if (!block_accessed) {
 		/* No segfault was hit, so we have R/W access to this page */
@@ -94,7 +1710,7 @@ static int get_page_access(unsigned long address)
 	return block_accessible;
 }
 
-/* Enable a signal handler to catch SIGSEGV events. */
+/* Enable a signal handler to catch SIGSEGV and SIGBUS events. */
 static void setup_signal_handler()
 {
 	struct sigaction sa;
@@ -104,6 +1720,7 @@ static void setup_signal_handler()
 	sa.sa_sigaction = segfault_sigaction;
 	sa.sa_flags = SA_SIGINFO;
 	sigaction(SIGSEGV, &sa, NULL);
+	sigaction(SIGBUS, &sa, NULL);
 }
 
 /* Handle SIGSEGV events.
@@ -114,12 +1731,19 @@ static void setup_signal_handler()
  *     SEGV_ACCERR: Address is mapped to the program but cannot be accessed.
  *                  This only happens when it is readable but not writable.
  *
+ * SIGBUS comes from mapped pages with nothing behind them, such as parts
+ * of [vvar] that a 64-bit scan reaches. Those count as mapped but not
+ * accessible, like SEGV_ACCERR.
+ *
  * The signal handler will use siglongjmp to pass the particular code back
  * to the program.
  */
 static void segfault_sigaction(int signal, siginfo_t *si, void *arg)
 {
-	if (si->si_code == SEGV_MAPERR) {
+	__sync_fetch_and_add(&fault_count, 1);
+	if (signal == SIGBUS) {
+		siglongjmp(jmpbuf, RET_ACCERR);
+	} else if (si->si_code == SEGV_MAPERR) {
 		siglongjmp(jmpbuf, RET_MAPERR);
 	} else if (si->si_code == SEGV_ACCERR) {
 		siglongjmp(jmpbuf, RET_ACCERR);
@@ -1,5 +1,8 @@
 #ifndef MEMCHUNK_H
 
+#include <sys/types.h>
+#include <limits.h>
+
 struct memchunk
 {
 	void *start;
@@ -7,8 +10,134 @@ struct memchunk
 	int RW;
 };
 
+/* A chunk with the attributes /proc/<pid>/maps knows about. Chunks are
+ * split wherever any of them changes. The layout may grow in later
+ * versions; callers pass the version they were built against.
+ */
+#define MEMCHUNK_EXT_VERSION 1
+#define MEMCHUNK_PATH_MAX 256
+
+struct memchunk_ext
+{
+	struct memchunk base;	/* start, length, RW as in struct memchunk */
+	int version;		/* MEMCHUNK_EXT_VERSION */
+	int flags;		/* MEMCHUNK_EXEC, _SHARED, _PRIVATE */
+	unsigned long offset;	/* offset of start in the backing file */
+	unsigned long resident;		/* pages in memory */
+	unsigned long nonresident;	/* pages not in memory */
+	char path[MEMCHUNK_PATH_MAX];	/* backing file or [name], or "" */
+};
+
+#define MEMCHUNK_EXEC    0x1
+#define MEMCHUNK_SHARED  0x2
+#define MEMCHUNK_PRIVATE 0x4
+
+/* A scan kept for fast queries. It is rebuilt when the process's
+ * mapped size (from /proc/self/statm) changes or memchunk_changed has
+ * been called since it was built. Not safe to share between threads.
+ */
+struct memchunk_index
+{
+	struct memchunk *list;	/* sorted, covering the address space */
+	int count;
+	int mode;		/* scan backend used to rebuild */
+	int statm_fd;		/* kept open so checks are one pread */
+	unsigned long size;	/* mapped pages when built */
+	unsigned long generation;	/* memchunk_changed count when built */
+};
+
+/* Page state bits in an export_heatmap run */
+#define HEAT_RESIDENT   0x1	/* in memory */
+#define HEAT_SWAPPED    0x2	/* in swap */
+#define HEAT_SOFT_DIRTY 0x4	/* written since the last clear_soft_dirty */
+#define HEAT_DIRTY      0x8	/* dirty page, needs /proc/kpageflags */
+#define HEAT_HUGE       0x10	/* part of a huge page, needs kpageflags */
+
+/* Scan backends for get_mem_layout_mode */
+#define MEMCHUNK_PROBE 0	/* touch every page, classify by SIGSEGV */
+#define MEMCHUNK_MAPS  1	/* parse /proc/self/maps (Linux only) */
+#define MEMCHUNK_CHECK 2	/* run both, report differences on stderr */
+#define MEMCHUNK_NOFAULT 3	/* probe through system calls, no signals */
+#define MEMCHUNK_BACKEND 0xff
+
+/* Flag for the probing backends: skip unmapped space in large blocks
+ * instead of visiting every page. The result is the same.
+ */
+#define MEMCHUNK_SKIP 0x100
+
+/* Flag for the probing backends: spread the scan over n threads, or one
+ * per CPU if n is 0. The result is the same.
+ */
+#define MEMCHUNK_PARALLEL 0x200
+#define MEMCHUNK_THREADS(n) (MEMCHUNK_PARALLEL | (((n) & 0xff) << 16))
+
+/* Last address a scan covers: 4GB on 32-bit, the 128TB user half of a
+ * 64-bit (48-bit virtual) address space otherwise.
+ */
+#if ULONG_MAX > 0xFFFFFFFFUL
+#define MEMCHUNK_ADDR_MAX 0x7FFFFFFFFFFFUL
+#else
+#define MEMCHUNK_ADDR_MAX 0xFFFFFFFFUL
+#endif
+
+#ifdef __linux__
+#define MEMCHUNK_DEFAULT MEMCHUNK_MAPS
+#else
+#define MEMCHUNK_DEFAULT MEMCHUNK_PROBE
+#endif
+
+/* A range whose classification differs between two layouts */
+struct memchunk_delta
+{
+	void *start;
+	unsigned long length;
+	int type;	/* MEMCHUNK_ADDED, _REMOVED or _CHANGED */
+	int old_RW;	/* RW before, -1 if it was unmapped */
+	int RW;		/* RW now, -1 if it is unmapped */
+};
+
+#define MEMCHUNK_ADDED   1	/* was unmapped, now mapped */
+#define MEMCHUNK_REMOVED 2	/* was mapped, now unmapped */
+#define MEMCHUNK_CHANGED 3	/* still mapped, RW changed */
+
+/* Called with each chunk of a streaming scan; nonzero stops the scan */
+typedef int (*memchunk_cb)(const struct memchunk *chunk, void *arg);
 
 int get_mem_layout(struct memchunk *chunk_list, int size);
+int get_mem_layout_mode(struct memchunk *chunk_list, int size, int mode);
+int get_mem_layout_parallel(struct memchunk *chunk_list, int size, int mode,
+			    int nthreads);
+int get_mem_layout_range(struct memchunk *chunk_list, int size, int mode,
+			 unsigned long start, unsigned long end);
+struct memchunk *get_mem_layout_alloc(int mode, unsigned long start,
+				      unsigned long end, int *count);
+int scan_mem_layout(int mode, unsigned long start, unsigned long end,
+		    memchunk_cb cb, void *arg);
+int get_mem_layout_pid(pid_t pid, struct memchunk *chunk_list, int size,
+		       int mode);
+struct memchunk *get_mem_layout_pid_alloc(pid_t pid, int mode,
+					  unsigned long start,
+					  unsigned long end, int *count);
+int get_mem_layout_ext(pid_t pid, struct memchunk_ext *chunk_list,
+		       int size, int version);
+unsigned long get_mem_layout_faults();
+int memchunk_index_init(struct memchunk_index *index, int mode);
+void memchunk_index_free(struct memchunk_index *index);
+void memchunk_changed();
+const struct memchunk *memchunk_index_find(struct memchunk_index *index,
+					   const void *address);
+int memchunk_index_range(struct memchunk_index *index, const void *start,
+			 unsigned long length,
+			 const struct memchunk **first);
+int memchunk_index_access(struct memchunk_index *index, const void *start,
+			  unsigned long length);
+int export_heatmap(pid_t pid, const char *path);
+int clear_soft_dirty(pid_t pid);
+int memchunk_diff(const struct memchunk *old_list, int old_count,
+		  const struct memchunk *new_list, int new_count,
+		  struct memchunk_delta *deltas, int size);
+struct memchunk *update_mem_layout(const struct memchunk *prev,
+				   int prev_count, int mode, int *count);
 
 #define MEMCHUNK_H
 #endif
@@ -0,0 +1,157 @@
+/* Memory layout monitor.
+ *
+ * Takes a full scan of the address space, then rescans it every interval
+ * with update_mem_layout and prints what changed, one JSON object per
+ * line. The first line describes everything mapped at the start. Samples
+ * with no changes print nothing.
+ *
+ * Pass -n (the default) to probe without signals or -p to probe with
+ * them, -i ms to set the interval and -k N to stop after N samples. -c
+ * maps, unmaps and reprotects some memory between samples, to show the
+ * output. -P pid watches another process through /proc/<pid>/maps
+ * instead.
+ */
+
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "memchunk.h"
+
+#define CHURN_PAGES 16
+
+static const char *delta_names[] = { "", "added", "removed", "changed" };
+
+static unsigned long now_us();
+static void print_sample(int sample, unsigned long time_us,
+			 unsigned long scan_us, int count,
+			 struct memchunk_delta *deltas, int ndeltas);
+static void churn(void **pages, int page_size);
+
+int main(int argc, char *argv[])
+{
+	struct memchunk *prev = NULL, *list;
+	struct memchunk_delta *deltas = NULL;
+	void *pages[CHURN_PAGES] = { NULL };
+	int mode = MEMCHUNK_NOFAULT;
+	int interval = 1000;
+	int samples = -1;
+	int do_churn = 0;
+	pid_t pid = 0;
+	int prev_count = 0, count, ndeltas, max_deltas = 0;
+	int sample, ch;
+	unsigned long start_us, scan_start;
+
+	while ((ch = getopt(argc, argv, "ci:k:npP:")) != -1) {
+		if (ch == 'c') {
+			do_churn = 1;
+		} else if (ch == 'i') {
+			interval = atoi(optarg);
+		} else if (ch == 'k') {
+			samples = atoi(optarg);
+		} else if (ch == 'n') {
+			mode = MEMCHUNK_NOFAULT;
+		} else if (ch == 'p') {
+			mode = MEMCHUNK_PROBE;
+		} else if (ch == 'P') {
+			pid = atoi(optarg);
+		} else {
+			fprintf(stderr, "usage: %s [-n | -p] [-c] [-i ms] "
+				"[-k samples] [-P pid]\n", argv[0]);
+			exit(1);
+		}
+	}
+
+	start_us = now_us();
+	for (sample = 0; samples < 0 || sample < samples; sample++) {
+		scan_start = now_us();
+		if (pid != 0)
+			list = get_mem_layout_pid_alloc(pid, MEMCHUNK_MAPS,
+							0, 0, &count);
+		else if (prev == NULL)
+			list = get_mem_layout_alloc(mode | MEMCHUNK_SKIP, 0, 0,
+						    &count);
+		else
+			list = update_mem_layout(prev, prev_count, mode,
+						 &count);
+		if (list == NULL) {
+			perror("scan");
+			exit(1);
+		}
+		scan_start = now_us() - scan_start;
+
+		ndeltas = memchunk_diff(prev, prev_count, list, count,
+					deltas, max_deltas);
+		if (ndeltas > max_deltas) {
+			free(deltas);
+			max_deltas = ndeltas * 2;
+			deltas = malloc(max_deltas * sizeof(*deltas));
+			if (deltas == NULL) {
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+			memchunk_diff(prev, prev_count, list, count,
+				      deltas, max_deltas);
+		}
+		if (ndeltas > 0)
+			print_sample(sample, now_us() - start_us, scan_start,
+				     count, deltas, ndeltas);
+
+		free(prev);
+		prev = list;
+		prev_count = count;
+
+		if (do_churn)
+			churn(pages, getpagesize());
+		usleep(interval * 1000);
+	}
+	free(prev);
+	free(deltas);
+	return 0;
+}
+
+static unsigned long now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static void print_sample(int sample, unsigned long time_us,
+			 unsigned long scan_us, int count,
+			 struct memchunk_delta *deltas, int ndeltas)
+{
+	int i;
+
+	printf("{\"sample\":%d,\"time_us\":%lu,\"scan_us\":%lu,"
+	       "\"chunks\":%d,\"deltas\":[", sample, time_us, scan_us, count);
+	for (i = 0; i < ndeltas; i++) {
+		printf("%s{\"type\":\"%s\",\"start\":\"0x%lx\","
+		       "\"length\":%lu,\"old_rw\":%d,\"rw\":%d}",
+		       i == 0 ? "" : ",", delta_names[deltas[i].type],
+		       (unsigned long) deltas[i].start, deltas[i].length,
+		       deltas[i].old_RW, deltas[i].RW);
+	}
+	printf("]}\n");
+	fflush(stdout);
+}
+
+/* Map, unmap or reprotect one random page. */
+static void churn(void **pages, int page_size)
+{
+	int i = rand() % CHURN_PAGES;
+
+	if (pages[i] == NULL) {
+		pages[i] = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (pages[i] == MAP_FAILED)
+			pages[i] = NULL;
+	} else if (rand() % 2) {
+		munmap(pages[i], page_size);
+		pages[i] = NULL;
+	} else {
+		mprotect(pages[i], page_size, PROT_READ);
+	}
+}
@@ -5,22 +5,131 @@
  * This program will execute get_mem_layout() and print out the results
  * to a terminal. If the number of chunks exceeds the size of the allocated
  * list, then a warning will be printed.
+ *
+ * Pass -p to force page probing, -n to probe without signals, -m to use
+ * /proc/self/maps, or -c to run both and report where they differ. Adding
+ * -s lets the probes skip unmapped space, which a 64-bit build needs, and
+ * -t N spreads a probing scan over N threads. -r start:end (hex) scans
+ * only that range, into a list that grows to fit. -P pid scans another
+ * process instead. -x lists each region's flags, backing file and
+ * resident bytes, -H file writes a page heat map to file, and -q addr
+ * (hex) looks up the chunk containing addr through an index.
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include "memchunk.h"
 
 #define LIST_SIZE 15
 
+static void print_ext(pid_t pid);
+
 int main(int argc, char *argv[])
 {
-	struct memchunk list[LIST_SIZE];
+	struct memchunk fixed[LIST_SIZE];
+	struct memchunk *list = fixed;
 	int num_chunks = 0;
-	int i;
+	unsigned long start = 0, end = 0;
+	int ranged = 0;
+	pid_t pid = 0;
+	int mode = MEMCHUNK_DEFAULT;
+	int skip = 0;
+	int nthreads = 0;
+	int ext = 0;
+	char *heatmap = NULL;
+	unsigned long query = 0;
+	int queried = 0;
+	int i, ch;
 
-	num_chunks = get_mem_layout(list, LIST_SIZE);
+	while ((ch = getopt(argc, argv, "cH:mnpP:q:r:st:x")) != -1) {
+		if (ch == 'c') {
+			mode = MEMCHUNK_CHECK;
+		} else if (ch == 'H') {
+			heatmap = optarg;
+		} else if (ch == 'm') {
+			mode = MEMCHUNK_MAPS;
+		} else if (ch == 'n') {
+			mode = MEMCHUNK_NOFAULT;
+		} else if (ch == 'p') {
+			mode = MEMCHUNK_PROBE;
+		} else if (ch == 'P') {
+			pid = atoi(optarg);
+		} else if (ch == 'q') {
+			query = strtoul(optarg, NULL, 16);
+			queried = 1;
+		} else if (ch == 'r') {
+			if (sscanf(optarg, "%lx:%lx", &start, &end) != 2) {
+				fprintf(stderr, "bad range %s\n", optarg);
+				exit(1);
+			}
+			ranged = 1;
+		} else if (ch == 's') {
+			skip = MEMCHUNK_SKIP;
+		} else if (ch == 't') {
+			nthreads = atoi(optarg);
+		} else if (ch == 'x') {
+			ext = 1;
+		} else {
+			fprintf(stderr, "usage: %s [-c | -m | -n | -p] [-s] [-t threads] [-r start:end] [-P pid] [-x] [-H file] [-q addr]\n", argv[0]);
+			exit(1);
+		}
+	}
 
- 	if (num_chunks > LIST_SIZE)
+	if (queried) {
+		struct memchunk_index index;
+		const struct memchunk *chunk;
+
+		if (memchunk_index_init(&index, mode | skip) == -1 ||
+		    (chunk = memchunk_index_find(&index,
+						 (void *) query)) == NULL) {
+			fprintf(stderr, "Lookup failed\n");
+			exit(1);
+		}
+		printf("%lX is in %lX-%lX, RW %d\n", query,
+		       (unsigned long) chunk->start,
+		       (unsigned long) chunk->start + chunk->length,
+		       chunk->RW);
+		memchunk_index_free(&index);
+		return 0;
+	}
+	if (heatmap != NULL) {
+		if (export_heatmap(pid, heatmap) == -1) {
+			perror("export_heatmap");
+			exit(1);
+		}
+		return 0;
+	}
+	if (ext) {
+		print_ext(pid);
+		return 0;
+	}
+	if (nthreads > 0)
+		mode |= MEMCHUNK_THREADS(nthreads);
+
+	if (ranged) {
+		list = get_mem_layout_pid_alloc(pid, mode | skip, start, end,
+						&num_chunks);
+		if (list == NULL) {
+			perror("get_mem_layout_pid_alloc");
+			exit(1);
+		}
+	} else if (pid != 0) {
+		num_chunks = get_mem_layout_pid(pid, list, LIST_SIZE,
+						mode | skip);
+		if (num_chunks == -1) {
+			perror("get_mem_layout_pid");
+			exit(1);
+		}
+	} else {
+		num_chunks = get_mem_layout_mode(list, LIST_SIZE, mode | skip);
+		if (num_chunks == -1) {
+			perror("get_mem_layout_mode");
+			exit(1);
+		}
+	}
+
+ 	if (!ranged && num_chunks > LIST_SIZE)
 	{
 		printf("Exceeded maximum list size of %d. Found %d chunks.\n",
 		       LIST_SIZE, num_chunks);
@@ -38,5 +147,44 @@ int main(int argc, char *argv[])
 		       (unsigned long) list[i].start + list[i].length,
 		       list[i].length, list[i].RW);
 	}
+	if (ranged)
+		free(list);
 	return 0;
 }
+
+/* Print the mapped regions with their extended attributes. */
+static void print_ext(pid_t pid)
+{
+	struct memchunk_ext *list;
+	int page_size = getpagesize();
+	int num_chunks, i;
+
+	num_chunks = get_mem_layout_ext(pid, NULL, 0, MEMCHUNK_EXT_VERSION);
+	if (num_chunks == -1) {
+		perror("get_mem_layout_ext");
+		exit(1);
+	}
+	/* leave room for chunks that appear in between */
+	list = malloc((num_chunks + 16) * sizeof(*list));
+	if (list == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	i = num_chunks + 16;
+	num_chunks = get_mem_layout_ext(pid, list, i, MEMCHUNK_EXT_VERSION);
+	if (num_chunks > i)
+		num_chunks = i;
+	for (i = 0; i < num_chunks; i++) {
+		if (list[i].base.RW == -1)
+			continue;
+		printf("%12lX-%12lX %s%c%c %8lX %10luK resident %s\n",
+		       (unsigned long) list[i].base.start,
+		       (unsigned long) list[i].base.start + list[i].base.length,
+		       list[i].base.RW ? "rw" : "r-",
+		       list[i].flags & MEMCHUNK_EXEC ? 'x' : '-',
+		       list[i].flags & MEMCHUNK_SHARED ? 's' : 'p',
+		       list[i].offset,
+		       list[i].resident * page_size / 1024, list[i].path);
+	}
+	free(list);
+}
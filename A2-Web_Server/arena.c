@@ -0,0 +1,57 @@
+#include <stdlib.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+
+/* Header in front of each oversized block so reset can find it */
+struct arena_large {
+	struct arena_large *next;
+	/* keep the payload aligned like arena blocks */
+	char pad[ARENA_ALIGN - sizeof(void *)];
+};
+
+unsigned long arena_heap_allocs;
+
+void arena_init(arena_t *arena, void *buf, size_t size) {
+	arena->base = buf;
+	arena->size = size;
+	arena->used = 0;
+	arena->large = NULL;
+	arena->heap_allocs = 0;
+}
+
+/* Returns len bytes aligned to ARENA_ALIGN, or NULL if malloc fails. */
+void *arena_alloc(arena_t *arena, size_t len) {
+	struct arena_large *l;
+	size_t start;
+
+	start = (arena->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (start <= arena->size && len <= arena->size - start) {
+		arena->used = start + len;
+		return arena->base + start;
+	}
+
+	if ((l = malloc(sizeof(*l) + len)) == NULL)
+		return NULL;
+	l->next = arena->large;
+	arena->large = l;
+	arena->heap_allocs++;
+	__sync_fetch_and_add(&arena_heap_allocs, 1);
+	return l + 1;
+}
+
+/*
+ * Discard everything allocated from the arena. This is a single store
+ * unless a request spilled onto the heap.
+ */
+void arena_reset(arena_t *arena) {
+	struct arena_large *l, *next;
+
+	for (l = arena->large; l != NULL; l = next) {
+		next = l->next;
+		free(l);
+	}
+	arena->large = NULL;
+	arena->used = 0;
+}
@@ -0,0 +1,28 @@
+#ifndef _H_ARENA
+#define _H_ARENA
+
+#include <stddef.h>
+
+/* Backing store handed to each connection by do_request */
+#define ARENA_SIZE (64 * 1024)
+
+/*
+ * A bump allocator over a caller-supplied buffer. Anything that does not
+ * fit falls back to malloc and is released by arena_reset.
+ */
+typedef struct {
+	char *base;
+	size_t size;
+	size_t used;
+	void *large;			/* list of malloc'd fallback blocks */
+	unsigned long heap_allocs;	/* fallbacks since arena_init */
+} arena_t;
+
+/* Fallback mallocs made by all arenas in this process */
+extern unsigned long arena_heap_allocs;
+
+void arena_init(arena_t *arena, void *buf, size_t size);
+void *arena_alloc(arena_t *arena, size_t len);
+void arena_reset(arena_t *arena);
+
+#endif
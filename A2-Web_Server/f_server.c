@@ -56,7 +56,15 @@ int main(int argc,  char *argv[])
 	struct stat s;
 	char *lf;
 	FILE *logfile;
+	int optidx;
 
+	/*
+	 * socket tuning flags come before the positional arguments; shift
+	 * past them so the rest of main still sees argv[1..3].
+	 */
+	optidx = parse_options(argc, argv);
+	argc -= optidx - 1;
+	argv += optidx - 1;
 	if (argc != 4)
 		usage();
 
@@ -107,6 +115,7 @@ int main(int argc,  char *argv[])
 	}
 	webroot = argv[2];
 	fprintf(stdout, "Web root is %s\n", webroot);
+	err_responses_init();
 
 	/*
 	 * third, get the log file to use
@@ -156,11 +165,13 @@ int main(int argc,  char *argv[])
 	}
 
 	for(;;) {
+		unsigned long long accepted;
 		int clientsd;
 		clientlen = sizeof(&client);
 		clientsd = accept(sd, (struct sockaddr *)&client, &clientlen);
 		if (clientsd == -1)
 			err(1, "accept failed");
+		accepted = TRACE_NOW();
 		/*
 		 * We fork child to deal with each connection, this way more
 		 * than one client can connect to us and get served at any one
@@ -172,7 +183,7 @@ int main(int argc,  char *argv[])
 		     err(1, "fork failed");
 
 		if(pid == 0) {
-			do_request(clientsd, &client, lf);
+			do_request(clientsd, &client, lf, accepted);
 			exit(0);
 		}
 		close(clientsd);
@@ -48,6 +48,7 @@ struct args_t {
 	int clientsd;
 	struct sockaddr_in client;
 	char *lf;
+	unsigned long long accepted;
 } args_t;
 
 pthread_mutex_t accept_lock;
@@ -65,7 +66,15 @@ int main(int argc,  char *argv[])
 	struct stat s;
 	char *lf;
 	FILE *logfile;
+	int optidx;
 
+	/*
+	 * socket tuning flags come before the positional arguments; shift
+	 * past them so the rest of main still sees argv[1..3].
+	 */
+	optidx = parse_options(argc, argv);
+	argc -= optidx - 1;
+	argv += optidx - 1;
 	if (argc != 4)
 		usage();
 
@@ -116,6 +125,7 @@ int main(int argc,  char *argv[])
 	}
 	webroot = argv[2];
 	fprintf(stdout, "Web root is %s\n", webroot);
+	err_responses_init();
 
 	/*
 	 * third, get the log file to use
@@ -178,6 +188,7 @@ int main(int argc,  char *argv[])
 		
 		if (clientsd == -1)
 			err(1, "accept failed");
+		args.accepted = TRACE_NOW();
 
 		memcpy(&args.clientsd, &clientsd, sizeof(clientsd));
 		memcpy(&args.client, &client, clientlen);
@@ -196,7 +207,7 @@ void *do_request_wrapper(void *args) {
 	struct args_t nargs;
 	memcpy(&nargs, (struct args_t *)args, sizeof(nargs));
 	pthread_mutex_unlock(&accept_lock);
-	do_request(nargs.clientsd, &nargs.client, nargs.lf);
+	do_request(nargs.clientsd, &nargs.client, nargs.lf, nargs.accepted);
 	close(nargs.clientsd);
 	return NULL;
 }
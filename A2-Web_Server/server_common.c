@@ -1,13 +1,16 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -21,13 +24,109 @@
 
 char *webroot;
 pthread_mutex_t log_lock;
+sockopts_t sockopts = { .backlog = 3 };
+
+/* Filled in by err_responses_init; 500 must stay last */
+typedef struct {
+	unsigned int code;
+	int body_len;
+	char *resp;		/* headers after Date, blank line, body */
+	size_t resp_len;
+} err_response_t;
+
+#define NUM_ERR_RESPONSES 4
+static err_response_t err_responses[NUM_ERR_RESPONSES] = {
+	{ 400 }, { 403 }, { 404 }, { 500 }
+};
+
+static int opt_number(const char *arg);
+static void set_sockopt(int sd, int level, int name, int value,
+    const char *label);
+static const char *status_line(unsigned int resp_code);
+static char *err_response(request_t *req, int *req_len);
+static int read_file(int fd, char *buffer, size_t len);
+static err_response_t *find_err_response(unsigned int resp_code);
+static ssize_t send_iov(int sd, struct iovec *iov, int iovcnt);
 
 void usage() {
 	extern char * __progname;
-	fprintf(stderr, "usage: %s portnumber webroot logfile\n", __progname);
+	fprintf(stderr, "usage: %s [-acnp] [-b backlog] [-d secs] [-f qlen] "
+	    "[-r bytes] [-s bytes]\n"
+	    "       [-t tracefile] portnumber webroot logfile\n", __progname);
 	exit(1);
 }
 
+/*
+ * Parse the socket tuning flags into sockopts. Returns the index of the
+ * first positional argument.
+ */
+int parse_options(int argc, char *argv[]) {
+	int ch;
+
+	while ((ch = getopt(argc, argv, "ab:cd:f:npr:s:t:")) != -1) {
+		switch (ch) {
+		case 'a':
+			sockopts.reuseaddr = 1;
+			break;
+		case 'b':
+			sockopts.backlog = opt_number(optarg);
+			break;
+		case 'c':
+			sockopts.cork = 1;
+			break;
+		case 'd':
+			sockopts.defer_accept = opt_number(optarg);
+			break;
+		case 'f':
+			sockopts.fastopen = opt_number(optarg);
+			break;
+		case 'n':
+			sockopts.nodelay = 1;
+			break;
+		case 'p':
+			sockopts.reuseport = 1;
+			break;
+		case 'r':
+			sockopts.rcvbuf = opt_number(optarg);
+			break;
+		case 's':
+			sockopts.sndbuf = opt_number(optarg);
+			break;
+		case 't':
+			trace_open(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	return optind;
+}
+
+/* Parse a non-negative integer option argument, or bail out. */
+static int opt_number(const char *arg) {
+	char *ep;
+	long v;
+
+	errno = 0;
+	v = strtol(arg, &ep, 10);
+	if (*arg == '\0' || *ep != '\0' || errno == ERANGE ||
+	    v < 0 || v > INT_MAX) {
+		fprintf(stderr, "%s - not a valid number\n", arg);
+		usage();
+	}
+	return v;
+}
+
+/*
+ * Socket options are tuning only, so failing to set one is reported
+ * but does not stop the server.
+ */
+static void set_sockopt(int sd, int level, int name, int value,
+    const char *label) {
+	if (setsockopt(sd, level, name, &value, sizeof(value)) == -1)
+		warn("setsockopt %s failed", label);
+}
+
 void kidhandler(int signum) {
 	/* signal handler for SIGCHLD */
 	waitpid(WAIT_ANY, NULL, WNOHANG);
@@ -77,68 +176,137 @@ int bind_socket(struct sockaddr_in sockname, u_short port) {
 	if ( sd == -1)
 		err(1, "socket failed");
 
+	if (sockopts.reuseaddr)
+		set_sockopt(sd, SOL_SOCKET, SO_REUSEADDR, 1, "SO_REUSEADDR");
+	if (sockopts.reuseport) {
+#ifdef SO_REUSEPORT
+		set_sockopt(sd, SOL_SOCKET, SO_REUSEPORT, 1, "SO_REUSEPORT");
+#else
+		warnx("SO_REUSEPORT not supported on this platform");
+#endif
+	}
+	/* buffer sizes must be set before listen to affect window scaling */
+	if (sockopts.sndbuf)
+		set_sockopt(sd, SOL_SOCKET, SO_SNDBUF, sockopts.sndbuf,
+		    "SO_SNDBUF");
+	if (sockopts.rcvbuf)
+		set_sockopt(sd, SOL_SOCKET, SO_RCVBUF, sockopts.rcvbuf,
+		    "SO_RCVBUF");
+
 	if (bind(sd, (struct sockaddr *) &sockname, sizeof(sockname)) == -1)
 		err(1, "bind failed");
 
-	if (listen(sd,3) == -1)
+	if (sockopts.defer_accept) {
+#ifdef TCP_DEFER_ACCEPT
+		set_sockopt(sd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+		    sockopts.defer_accept, "TCP_DEFER_ACCEPT");
+#else
+		warnx("TCP_DEFER_ACCEPT not supported on this platform");
+#endif
+	}
+	if (sockopts.fastopen) {
+#ifdef TCP_FASTOPEN
+		set_sockopt(sd, IPPROTO_TCP, TCP_FASTOPEN, sockopts.fastopen,
+		    "TCP_FASTOPEN");
+#else
+		warnx("TCP_FASTOPEN not supported on this platform");
+#endif
+	}
+
+	if (listen(sd, sockopts.backlog) == -1)
 		err(1, "listen failed");
 
 	return sd;
 }
 
-request_t parse_request(int sd) {
-	char request[1024];
+/* Apply per-connection options to a freshly accepted socket. */
+void client_socket_setup(int sd) {
+	if (sockopts.nodelay)
+		set_sockopt(sd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+}
+
+/*
+ * With -c the headers and body are corked so they leave in as few
+ * segments as possible; uncorking flushes whatever is queued.
+ */
+void cork_socket(int sd, int on) {
+	if (!sockopts.cork)
+		return;
+#ifdef TCP_CORK
+	set_sockopt(sd, IPPROTO_TCP, TCP_CORK, on, "TCP_CORK");
+#endif
+}
+
+void parse_request(int sd, request_t *req, arena_t *arena) {
+	char *request;
 	char req_ln[256];
-	request_t req;
+	ssize_t len;
 	int start = 0;
 	char *first_nl;
 	char *token;
 	char *path;
 
-	strcpy(req.request_line, "--");
-	strcpy(req.resp_string, "200 OK");
-	req.response_code = 200;
-	req.content_length = 0;
+	strcpy(req->request_line, "--");
+	strcpy(req->resp_string, "200 OK");
+	req->response_code = 200;
+	req->content_length = 0;
+	req->path = NULL;
 
-	/* Get request */
-	if (read(sd, request, sizeof(request)) == -1) {
+	/*
+	 * Get request. The buffer comes from the connection's arena so the
+	 * parsed path stays valid for the rest of do_request.
+	 */
+	request = arena_alloc(arena, REQUEST_SIZE + 1);
+	if (request == NULL || (len = read(sd, request, REQUEST_SIZE)) == -1) {
 		fprintf(stderr, "Failed to read request\n");
-		req.response_code = 500;
-		return req;
+		req->response_code = 500;
+		return;
 	}
+	request[len] = '\0';
+	TRACE(&req->trace, TR_FIRST_BYTE);
 	
 	/* Get first line of request */
 	first_nl = strstr(request, "\n");
-	strncpy(req_ln, request, min(sizeof(req_ln), (size_t)first_nl - (size_t)request));
-	req_ln[first_nl - request] = '\0';
+	if (first_nl == NULL || first_nl == request) {
+		fprintf(stderr, "Invalid request: Missing request line.\n");
+		req->response_code = 400;
+		return;
+	}
+	strncpy(req_ln, request, min(sizeof(req_ln) - 1, (size_t)first_nl - (size_t)request));
+	req_ln[min(sizeof(req_ln) - 1, first_nl - request)] = '\0';
 	/* remove carriage return if present */
-	if (req_ln[first_nl - request - 1] == '\r')
-		req_ln[first_nl - request - 1] = '\0';
+	if (req_ln[strlen(req_ln) - 1] == '\r')
+		req_ln[strlen(req_ln) - 1] = '\0';
 
 	token = strtok(request, " ");
 	start += strlen(token) + 1;
 	if (strcmp("GET", token) != 0) {
 		fprintf(stderr, "Invalid request: Missing GET token.\n");
-		req.response_code = 400;
-		return req;
+		req->response_code = 400;
+		return;
 	}
 	path = strtok(NULL, " ");
+	token = path ? strtok(NULL, "\n") : NULL;
+	if (token == NULL) {
+		fprintf(stderr, "Invalid request: Truncated request line.\n");
+		req->response_code = 400;
+		return;
+	}
 	start += strlen(path) + 1;
-	token = strtok(NULL, "\n");
 	start += strlen(token) + 1;
 	if (strncmp("HTTP/1.1", token, 8) != 0) {
 		fprintf(stderr, "Invalid request: Missing HTTP/1.1 token. Got %s\n", token);
-		req.response_code = 400;
-		return req;
+		req->response_code = 400;
+		return;
 	}
-	if (strstr(&request[start], "\n\n") == NULL && strstr(&request[start], "\r\n\r\n") == NULL) {
+	if (start > len || (strstr(&request[start], "\n\n") == NULL &&
+	    strstr(&request[start], "\r\n\r\n") == NULL)) {
 		fprintf(stderr, "Invalid request: Missing blank line.\n");
-		req.response_code = 400;
-		return req;
+		req->response_code = 400;
+		return;
 	}
-	strncpy(req.request_line, req_ln, sizeof(req.request_line));
-	req.path = path;
-	return req;
+	strncpy(req->request_line, req_ln, sizeof(req->request_line));
+	req->path = path;
 }
 
 int get_err_text(int resp_code, char* buffer, int buffer_len) {
@@ -170,50 +338,149 @@ int get_err_text(int resp_code, char* buffer, int buffer_len) {
 	return strlen(buffer);
 }
 
-char *get_response(request_t *req, int* req_len) {
+/*
+ * Returns the body for a 200 response. For errors it returns NULL and the
+ * caller sends the prebuilt response with send_err_response instead.
+ */
+char *get_response(request_t *req, int* req_len, arena_t *arena) {
 	struct stat s;
 	char *buffer;
 	char path_buffer[1024];
 	int fp;
 
-	if (req->response_code == 400) {
-		strcpy(req->resp_string, "400");
+	if (req->response_code != 200) {
+		/* the request itself could not be read or parsed */
 		strcpy(req->request_line, "--");
-		buffer = malloc(1024);
-		*req_len = get_err_text(req->response_code, buffer, 1024);
-		return buffer;
+		return err_response(req, req_len);
 	}
 	req_path_string(req, path_buffer, sizeof(path_buffer));
 	if (stat(path_buffer, &s) == -1 || S_ISDIR(s.st_mode)) {
 		if (errno == ENOENT) {
 			req->response_code = 404;
-			strcpy(req->resp_string, "404");
 		} else if (errno == EACCES) {
 			req->response_code = 403;
-			strcpy(req->resp_string, "403");
+		} else {
+			req->response_code = 500;
 		}
 		if (S_ISDIR(s.st_mode)) {
 			req->response_code = 403;
-			strcpy(req->resp_string, "403");
 		}
-		buffer = malloc(1024);
-		*req_len = get_err_text(req->response_code, buffer, 1024);
-		return buffer;
+		return err_response(req, req_len);
 	}
 	
 	if ((fp = open(path_buffer, O_RDONLY)) == -1) {
 		req->response_code = 403;
-		strcpy(req->resp_string, "403");
-		buffer = malloc(1024);
-		*req_len = get_err_text(req->response_code, buffer, 1024);
-		return buffer;
+		return err_response(req, req_len);
+	}
+	TRACE(&req->trace, TR_FILE_OPENED);
+	/* small files come straight out of the arena, large ones spill */
+	buffer = arena_alloc(arena, s.st_size);
+	if (buffer == NULL || read_file(fp, buffer, s.st_size) == -1) {
+		close(fp);
+		req->response_code = 500;
+		return err_response(req, req_len);
 	}
-	buffer = malloc(s.st_size);
-	read(fp, buffer, s.st_size);
+	close(fp);
 	*req_len = s.st_size;
 	return buffer;
 }
 
+/*
+ * read exactly len bytes, resuming after short reads. Returns -1 on an
+ * error or if the file ends early (it shrank since the stat).
+ */
+static int read_file(int fd, char *buffer, size_t len) {
+	size_t done;
+	ssize_t r;
+
+	done = 0;
+	while (done < len) {
+		r = read(fd, buffer + done, len - done);
+		if (r == -1) {
+			if (errno != EINTR)
+				return -1;
+			continue;
+		}
+		if (r == 0)
+			return -1;
+		done += r;
+	}
+	return 0;
+}
+
+/* Record an error outcome in req; always returns NULL for get_response. */
+static char *err_response(request_t *req, int *req_len) {
+	err_response_t *e = find_err_response(req->response_code);
+
+	req->response_code = e->code;
+	snprintf(req->resp_string, sizeof(req->resp_string), "%u", e->code);
+	*req_len = e->body_len;
+	return NULL;
+}
+
+static err_response_t *find_err_response(unsigned int resp_code) {
+	int i;
+
+	for (i = 0; i < NUM_ERR_RESPONSES - 1; i++) {
+		if (err_responses[i].code == resp_code)
+			return &err_responses[i];
+	}
+	/* anything unexpected is reported as a 500 */
+	return &err_responses[NUM_ERR_RESPONSES - 1];
+}
+
+/*
+ * Build the complete error responses, minus the Date header, once at
+ * startup. A file named after the status code in the webroot (e.g.
+ * 404.html) replaces the built-in body.
+ */
+void err_responses_init() {
+	char body[ERR_TEXT_SIZE];
+	char path_buffer[1024];
+	char *file_body;
+	struct stat s;
+	int body_len, hdr_len;
+	int i, fd;
+
+	for (i = 0; i < NUM_ERR_RESPONSES; i++) {
+		err_response_t *e = &err_responses[i];
+
+		file_body = NULL;
+		body_len = get_err_text(e->code, body, sizeof(body));
+		snprintf(path_buffer, sizeof(path_buffer), "%s/%u.html",
+		    webroot, e->code);
+		if (stat(path_buffer, &s) == 0 && S_ISREG(s.st_mode) &&
+		    (fd = open(path_buffer, O_RDONLY)) != -1) {
+			if ((file_body = malloc(s.st_size)) == NULL)
+				err(1, "malloc failed");
+			if (read(fd, file_body, s.st_size) == s.st_size) {
+				body_len = s.st_size;
+			} else {
+				warnx("short read on %s, using default", path_buffer);
+				free(file_body);
+				file_body = NULL;
+			}
+			close(fd);
+		}
+
+		hdr_len = snprintf(NULL, 0,
+		    "Content-Type: text/html\n"
+		    "Content-Length: %d\n"
+		    "\n", body_len);
+		e->resp_len = hdr_len + body_len;
+		if ((e->resp = malloc(e->resp_len + 1)) == NULL)
+			err(1, "malloc failed");
+		snprintf(e->resp, hdr_len + 1,
+		    "Content-Type: text/html\n"
+		    "Content-Length: %d\n"
+		    "\n", body_len);
+		memcpy(e->resp + hdr_len, file_body ? file_body : body,
+		    body_len);
+		e->body_len = body_len;
+		free(file_body);
+	}
+}
+
 void log_request(request_t *req, char* logfile) {
 	int fd;
 	char buffer[1024];
@@ -243,30 +510,96 @@ void log_request(request_t *req, char* logfile) {
 	pthread_mutex_unlock(&log_lock);
 }
 
-void send_headers(int sd, request_t *req) {
-	char date_buf[80];
-	char buffer[1024];
-	if (req->response_code == 200) {
-		send_response(sd, "HTTP/1.1 200 OK\n");
-	} else if (req->response_code == 400) {
-		send_response(sd, "HTTP/1.1 400 Bad Request\n");
-	} else if (req->response_code == 404) {
-		send_response(sd, "HTTP/1.1 404 Not Found\n");
-	} else if (req->response_code == 403) {
-		send_response(sd, "HTTP/1.1 403 Forbidden\n");
+static const char *status_line(unsigned int resp_code) {
+	if (resp_code == 200) {
+		return "HTTP/1.1 200 OK\n";
+	} else if (resp_code == 400) {
+		return "HTTP/1.1 400 Bad Request\n";
+	} else if (resp_code == 404) {
+		return "HTTP/1.1 404 Not Found\n";
+	} else if (resp_code == 403) {
+		return "HTTP/1.1 403 Forbidden\n";
 	} else {
-		send_response(sd, "HTTP/1.1 500 Internal Server Error\n");
+		return "HTTP/1.1 500 Internal Server Error\n";
 	}
+}
+
+/* Format the whole header block in the arena and send it in one write.
+ * If the arena can't provide it, a stack buffer does. */
+void send_headers(int sd, request_t *req, arena_t *arena) {
+	char date_buf[80];
+	char fallback[HEADER_SIZE];
+	char *buffer;
+	int len;
+
+	date_string(date_buf, sizeof(date_buf));
+	if ((buffer = arena_alloc(arena, HEADER_SIZE)) == NULL)
+		buffer = fallback;
+	len = snprintf(buffer, HEADER_SIZE,
+	    "%s"
+	    "Date: %s\n"
+	    "Content-Type: text/html\n"
+	    "Content-Length: %d\n"
+	    "\n",
+	    status_line(req->response_code), date_buf, req->content_length);
+	send_buffer(sd, buffer, min(len, HEADER_SIZE - 1));
+}
+
+/*
+ * Send a prebuilt error response: status line, the only per-request
+ * header, then the cached remainder, all in one writev. Returns the
+ * number of body bytes written.
+ */
+ssize_t send_err_response(int sd, request_t *req) {
+	err_response_t *e = find_err_response(req->response_code);
+	char date_buf[80];
+	char date_hdr[96];
+	struct iovec iov[3];
+
 	date_string(date_buf, sizeof(date_buf));
-    snprintf(buffer, sizeof(buffer), "Date: %s\n", date_buf);
-	send_response(sd, buffer);
-	send_response(sd, "Content-Type: text/html\n");
-	snprintf(buffer, sizeof(buffer), "Content-Length: %d\n", req->content_length);
-	send_response(sd, buffer);
-	send_response(sd, "\n");
+	iov[0].iov_base = (void *)status_line(e->code);
+	iov[0].iov_len = strlen(iov[0].iov_base);
+	iov[1].iov_base = date_hdr;
+	iov[1].iov_len = snprintf(date_hdr, sizeof(date_hdr), "Date: %s\n",
+	    date_buf);
+	iov[2].iov_base = e->resp;
+	iov[2].iov_len = e->resp_len;
+	send_iov(sd, iov, 3);
+	return e->body_len;
+}
+
+/* writev the whole vector, resuming after short writes. */
+static ssize_t send_iov(int sd, struct iovec *iov, int iovcnt) {
+	ssize_t written, w;
+
+	written = 0;
+	while (iovcnt > 0) {
+		w = writev(sd, iov, iovcnt);
+		if (w == -1) {
+			if (errno != EINTR)
+				err(1, "write failed");
+			continue;
+		}
+		written += w;
+		/* skip whatever was fully sent, trim what was partly sent */
+		while (iovcnt > 0 && (size_t)w >= iov->iov_len) {
+			w -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + w;
+			iov->iov_len -= w;
+		}
+	}
+	return written;
 }
 
 ssize_t send_response(int sd, char *buffer) {
+	return send_buffer(sd, buffer, strlen(buffer));
+}
+
+ssize_t send_buffer(int sd, const char *buffer, size_t len) {
 	ssize_t written, w;
 	/*
 	 * write the message to the client, being sure to
@@ -275,9 +608,8 @@ ssize_t send_response(int sd, char *buffer) {
 	 */
 	w = 0;
 	written = 0;
-	while (written < strlen(buffer)) {
-		w = write(sd, buffer + written,
-		    strlen(buffer) - written);
+	while (written < len) {
+		w = write(sd, buffer + written, len - written);
 		if (w == -1) {
 			if (errno != EINTR)
 				err(1, "write failed");
@@ -288,21 +620,50 @@ ssize_t send_response(int sd, char *buffer) {
 	return written;
 }
 
-void do_request(int clientsd, struct sockaddr_in * client, char* logfile) {
+/*
+ * accepted is the TRACE_NOW() timestamp taken right after accept, or 0
+ * when tracing is off.
+ */
+void do_request(int clientsd, struct sockaddr_in * client, char* logfile,
+    unsigned long long accepted) {
+	char arena_buf[ARENA_SIZE];
+	arena_t arena;
 	char* response;
 	request_t req;
 	int req_len;
 	int written;
 
-	req = parse_request(clientsd);
-	response = get_response(&req, &req_len);
+	if (TRACE_ON()) {
+		memset(&req.trace, 0, sizeof(req.trace));
+		req.trace.ts[TR_ACCEPT] = accepted;
+	}
+	arena_init(&arena, arena_buf, sizeof(arena_buf));
+	client_socket_setup(clientsd);
+	parse_request(clientsd, &req, &arena);
+	TRACE(&req.trace, TR_PARSED);
+	response = get_response(&req, &req_len, &arena);
 	req.content_length = req_len;
-	send_headers(clientsd, &req);
-	written = send_response(clientsd, response);
-	free(response);
+	cork_socket(clientsd, 1);
+	if (response == NULL) {
+		/* status line, headers and body leave in one writev */
+		written = send_err_response(clientsd, &req);
+		TRACE(&req.trace, TR_HEADERS_SENT);
+	} else {
+		send_headers(clientsd, &req, &arena);
+		TRACE(&req.trace, TR_HEADERS_SENT);
+		written = send_buffer(clientsd, response, req_len);
+	}
+	cork_socket(clientsd, 0);
+	TRACE(&req.trace, TR_BODY_SENT);
 	req.sockaddr = client;
+	req.heap_allocs = arena.heap_allocs;
 	if (req.response_code == 200) {
 		sprintf(req.resp_string, "200 OK %d/%d", written, req.content_length);
 	}
 	log_request(&req, logfile);
+	if (TRACE_ON()) {
+		req.trace.ts[TR_LOGGED] = trace_now();
+		trace_commit(&req.trace, req.response_code);
+	}
+	arena_reset(&arena);
 }
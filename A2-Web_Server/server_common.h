@@ -3,6 +3,9 @@
 
 #include <pthread.h>
 
+#include "arena.h"
+#include "trace.h"
+
 #define HTTP_200 HTTP/1.1 200 OK\n
 #define HTTP_400 HTTP/1.1 400 Bad Request\n
 #define HTTP_403 HTTP/1.1 403 Forbidden\n
@@ -11,6 +14,10 @@
 
 #define HTTP_CT Content-Type: text/html\n
 
+#define REQUEST_SIZE 1024
+#define HEADER_SIZE 256
+#define ERR_TEXT_SIZE 1024
+
 typedef struct {
 	char *path;
 	unsigned int response_code;
@@ -18,24 +25,47 @@ typedef struct {
 	char request_line[1024];
 	char resp_string[256];
 	int content_length;
+	unsigned long heap_allocs;	/* arena fallbacks while serving */
+	trace_rec_t trace;		/* only filled in when tracing */
 } request_t;
 
+/* Socket tuning, set from the command line by parse_options() */
+typedef struct {
+	int reuseaddr;
+	int reuseport;
+	int defer_accept;	/* seconds to wait for data, 0 = off */
+	int fastopen;		/* pending TFO queue length, 0 = off */
+	int nodelay;
+	int cork;
+	int sndbuf;		/* bytes, 0 = system default */
+	int rcvbuf;		/* bytes, 0 = system default */
+	int backlog;
+} sockopts_t;
+
 extern char* webroot;
 extern pthread_mutex_t log_lock;
+extern sockopts_t sockopts;
 
 void usage();
+int parse_options(int argc, char *argv[]);
 void kidhandler(int signum);
 void sighandler_setup();
 void date_string(char* buffer, size_t buf_size);
 void ip_addr_string(struct sockaddr_in* sock, char* buffer, size_t buf_size); 
 void req_path_string(request_t *req, char* buffer, int buffer_len);
 int bind_socket(struct sockaddr_in sockname, u_short port);
-request_t parse_request(int sd);
+void client_socket_setup(int sd);
+void cork_socket(int sd, int on);
+void parse_request(int sd, request_t *req, arena_t *arena);
 int get_err_text(int resp_code, char* buffer, int buffer_len);
-void send_headers(int sd, request_t *req);
-char *get_response(request_t *req, int *req_len);
+void err_responses_init();
+void send_headers(int sd, request_t *req, arena_t *arena);
+char *get_response(request_t *req, int *req_len, arena_t *arena);
 void log_request(request_t *req, char* logfile);
 ssize_t send_response(int sd, char *buffer);
-void do_request(int sd, struct sockaddr_in *client, char* logfile);
+ssize_t send_buffer(int sd, const char *buffer, size_t len);
+ssize_t send_err_response(int sd, request_t *req);
+void do_request(int sd, struct sockaddr_in *client, char* logfile,
+    unsigned long long accepted);
 
 #endif
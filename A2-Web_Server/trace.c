@@ -0,0 +1,67 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+trace_hdr_t *trace_buf;
+
+/*
+ * Create and map the trace file. It is mapped shared before the server
+ * forks or spawns threads, so every worker writes into the same ring.
+ */
+void trace_open(const char *path) {
+	size_t len;
+	void *p;
+	int fd;
+
+	len = sizeof(trace_hdr_t) + TRACE_RECORDS * sizeof(trace_rec_t);
+	if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1)
+		err(1, "open %s failed", path);
+	if (ftruncate(fd, len) == -1)
+		err(1, "ftruncate %s failed", path);
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		err(1, "mmap %s failed", path);
+	close(fd);
+
+	trace_buf = p;
+	memcpy(trace_buf->magic, TRACE_MAGIC, sizeof(trace_buf->magic));
+	trace_buf->nrecs = TRACE_RECORDS;
+	trace_buf->rec_size = sizeof(trace_rec_t);
+	trace_buf->next = 0;
+}
+
+unsigned long long trace_now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Copy a finished request into the next ring slot. seq is stored last
+ * so a reader can tell a complete record from one being overwritten.
+ */
+void trace_commit(trace_rec_t *rec, unsigned int response_code) {
+	unsigned long long n;
+	trace_rec_t *slot;
+
+	n = __sync_fetch_and_add(&trace_buf->next, 1);
+	slot = (trace_rec_t *)(trace_buf + 1) + n % trace_buf->nrecs;
+	slot->seq = 0;
+	__sync_synchronize();
+	slot->pid = getpid();
+	slot->tid = syscall(SYS_gettid);
+	slot->response_code = response_code;
+	memcpy(slot->ts, rec->ts, sizeof(slot->ts));
+	__sync_synchronize();
+	slot->seq = n + 1;
+}
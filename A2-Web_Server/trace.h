@@ -0,0 +1,56 @@
+#ifndef _H_TRACE
+#define _H_TRACE
+
+/*
+ * Optional per-request tracing. With -t the server maps a trace file
+ * shared by every worker; each request claims one fixed-size record in
+ * it. trace_export turns the file into Chrome trace-event JSON.
+ */
+
+#define TRACE_MAGIC "WSTRACE1"
+#define TRACE_RECORDS 65536
+
+/* Points in a request's life, in the order they happen */
+enum trace_point {
+	TR_ACCEPT,
+	TR_FIRST_BYTE,
+	TR_PARSED,
+	TR_FILE_OPENED,
+	TR_HEADERS_SENT,
+	TR_BODY_SENT,
+	TR_LOGGED,
+	TR_NUM_POINTS
+};
+
+typedef struct {
+	char magic[8];
+	unsigned int nrecs;		/* capacity of the ring */
+	unsigned int rec_size;
+	unsigned long long next;	/* records claimed so far */
+} trace_hdr_t;
+
+typedef struct {
+	unsigned long long seq;		/* claim number + 1 once complete */
+	unsigned int pid;
+	unsigned int tid;
+	unsigned int response_code;
+	unsigned int pad;
+	/* CLOCK_MONOTONIC in ns, 0 if the point was never reached */
+	unsigned long long ts[TR_NUM_POINTS];
+} trace_rec_t;
+
+/* NULL unless tracing was requested */
+extern trace_hdr_t *trace_buf;
+
+#define TRACE_ON() __builtin_expect(trace_buf != NULL, 0)
+#define TRACE_NOW() (TRACE_ON() ? trace_now() : 0)
+#define TRACE(rec, point) do {						\
+	if (TRACE_ON())							\
+		(rec)->ts[(point)] = trace_now();			\
+} while (0)
+
+void trace_open(const char *path);
+unsigned long long trace_now();
+void trace_commit(trace_rec_t *rec, unsigned int response_code);
+
+#endif
@@ -0,0 +1,100 @@
+/* trace_export - convert a server trace file to Chrome trace-event JSON
+ *
+ * Stephen Just
+ *
+ * Reads the ring written by a server started with -t and prints one
+ * complete ("X") event per request plus one per phase, suitable for
+ * chrome://tracing or Perfetto.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* Phase names, indexed by the trace point that ends the phase */
+static const char *phase_names[TR_NUM_POINTS] = {
+	"accept", "wait for request", "parse", "open file",
+	"send headers", "send body", "log"
+};
+
+static void print_event(int *first, const char *name, unsigned int pid,
+    unsigned int tid, unsigned long long start, unsigned long long end,
+    unsigned int code);
+
+int main(int argc, char *argv[])
+{
+	trace_hdr_t *hdr;
+	trace_rec_t *recs;
+	unsigned long long n, i, count;
+	struct stat s;
+	int fd, first = 1;
+
+	if (argc != 2) {
+		extern char * __progname;
+		fprintf(stderr, "usage: %s tracefile\n", __progname);
+		exit(1);
+	}
+	if ((fd = open(argv[1], O_RDONLY)) == -1)
+		err(1, "open %s failed", argv[1]);
+	if (fstat(fd, &s) == -1)
+		err(1, "stat %s failed", argv[1]);
+	if ((size_t)s.st_size < sizeof(*hdr))
+		errx(1, "%s is too short to be a trace", argv[1]);
+	hdr = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		err(1, "mmap %s failed", argv[1]);
+	if (memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0 ||
+	    hdr->rec_size != sizeof(trace_rec_t) ||
+	    sizeof(*hdr) + (size_t)hdr->nrecs * hdr->rec_size > (size_t)s.st_size)
+		errx(1, "%s is not a trace file", argv[1]);
+	recs = (trace_rec_t *)(hdr + 1);
+
+	/* Only the last nrecs claims are still in the ring */
+	n = hdr->next;
+	count = n < hdr->nrecs ? n : hdr->nrecs;
+
+	printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (i = n - count; i < n; i++) {
+		trace_rec_t *r = &recs[i % hdr->nrecs];
+		unsigned long long prev;
+		int p;
+
+		/* skip slots that were being rewritten while we read */
+		if (r->seq != i + 1 || r->ts[TR_ACCEPT] == 0)
+			continue;
+		print_event(&first, "request", r->pid, r->tid,
+		    r->ts[TR_ACCEPT], r->ts[TR_LOGGED], r->response_code);
+		prev = r->ts[TR_ACCEPT];
+		for (p = TR_FIRST_BYTE; p < TR_NUM_POINTS; p++) {
+			if (r->ts[p] == 0)
+				continue;
+			print_event(&first, phase_names[p], r->pid, r->tid,
+			    prev, r->ts[p], r->response_code);
+			prev = r->ts[p];
+		}
+	}
+	printf("\n]}\n");
+	return 0;
+}
+
+/* Chrome wants microseconds; keep the nanoseconds as a fraction. */
+static void print_event(int *first, const char *name, unsigned int pid,
+    unsigned int tid, unsigned long long start, unsigned long long end,
+    unsigned int code)
+{
+	printf("%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,"
+	    "\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,"
+	    "\"args\":{\"status\":%u}}",
+	    *first ? "" : ",\n", name, pid, tid,
+	    start / 1000, start % 1000,
+	    (end - start) / 1000, (end - start) % 1000, code);
+	*first = 0;
+}
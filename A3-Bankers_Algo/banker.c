@@ -0,0 +1,218 @@
+#include <stdlib.h>
+#include <string.h>
+#include "banker.h"
+#include "vecops.h"
+
+#define ROW(banker, matrix, process) \
+	(&(banker)->matrix[(size_t) (process) * (banker)->num_types])
+
+static int admit(banker_t *banker, int process);
+static int prefix_safe(banker_t *banker, int last);
+static int full_safe(banker_t *banker, int extra);
+static void sequence_insert(banker_t *banker, int index, int process);
+static void sequence_remove(banker_t *banker, int index);
+
+/* Set up a system with total instances of each resource type, all
+   available, and no processes admitted. Returns -1 if out of memory. */
+int banker_init(banker_t *banker, int num_types, const int *total,
+				int num_processes) {
+	size_t cells = (size_t) num_types * num_processes;
+	int i;
+
+	memset(banker, 0, sizeof(*banker));
+	banker->num_types = num_types;
+	banker->num_processes = num_processes;
+	banker->available = malloc(num_types * sizeof(int));
+	banker->max = calloc(cells, sizeof(int));
+	banker->allocation = calloc(cells, sizeof(int));
+	banker->need = calloc(cells, sizeof(int));
+	banker->sequence = malloc(num_processes * sizeof(int));
+	banker->position = malloc(num_processes * sizeof(int));
+	banker->work = malloc(num_types * sizeof(int));
+	if (banker->available == NULL || banker->max == NULL ||
+		banker->allocation == NULL || banker->need == NULL ||
+		banker->sequence == NULL || banker->position == NULL ||
+		banker->work == NULL) {
+		banker_free(banker);
+		return -1;
+	}
+	memcpy(banker->available, total, num_types * sizeof(int));
+	for (i = 0; i < num_processes; i++) {
+		banker->position[i] = -1;
+	}
+	return 0;
+}
+
+void banker_free(banker_t *banker) {
+	free(banker->available);
+	free(banker->max);
+	free(banker->allocation);
+	free(banker->need);
+	free(banker->sequence);
+	free(banker->position);
+	free(banker->work);
+	memset(banker, 0, sizeof(*banker));
+}
+
+/* Declare the most a process will ever hold. Only valid while the
+   process is not admitted. */
+void banker_set_max(banker_t *banker, int process, const int *max) {
+	memcpy(ROW(banker, max, process), max, banker->num_types * sizeof(int));
+	memcpy(ROW(banker, need, process), max, banker->num_types * sizeof(int));
+}
+
+/* Ask for more resources for a process, admitting it if this is its
+   first request. Returns BANKER_GRANTED, BANKER_WAIT if the resources
+   aren't available or granting them would be unsafe, or BANKER_INVALID
+   if the request exceeds the process's remaining claim. */
+int banker_request(banker_t *banker, int process, const int *request) {
+	int *need = ROW(banker, need, process);
+	int *allocation = ROW(banker, allocation, process);
+	int admitting = banker->position[process] == -1;
+	int m = banker->num_types;
+
+	if (!vec_le(request, need, m))
+		return BANKER_INVALID;
+	if (!vec_le(request, banker->available, m))
+		return BANKER_WAIT;
+
+	/* Grant it for now, and take it back if the result is unsafe */
+	vec_move(banker->available, allocation, request, m);
+	vec_sub(need, request, m);
+	if (admitting ? admit(banker, process) :
+		prefix_safe(banker, banker->position[process])) {
+		banker->quick_checks++;
+		return BANKER_GRANTED;
+	}
+	banker->full_checks++;
+	if (full_safe(banker, admitting ? process : -1))
+		return BANKER_GRANTED;
+
+	vec_move(allocation, banker->available, request, m);
+	vec_add(need, request, m);
+	return BANKER_WAIT;
+}
+
+/* A process has finished: return everything it holds. */
+void banker_release(banker_t *banker, int process) {
+	int *allocation = ROW(banker, allocation, process);
+
+	vec_add(banker->available, allocation, banker->num_types);
+	memset(allocation, 0, banker->num_types * sizeof(int));
+	memcpy(ROW(banker, need, process), ROW(banker, max, process),
+		   banker->num_types * sizeof(int));
+	if (banker->position[process] != -1)
+		sequence_remove(banker, banker->position[process]);
+}
+
+/* Check the current state from scratch, for testing. */
+int banker_is_safe(banker_t *banker) {
+	return full_safe(banker, -1);
+}
+
+/* Fit a newly admitted process, whose first request has already been
+   granted, into the safe sequence. If it could finish with what is
+   available now it goes first, and releases enough afterwards for the
+   rest of the sequence to run as before. Otherwise it goes last, where
+   everything else has been released, but the whole sequence has to be
+   checked again with the resources it holds. Returns 0 if neither
+   works. */
+static int admit(banker_t *banker, int process) {
+	if (vec_le(ROW(banker, need, process), banker->available,
+			   banker->num_types)) {
+		sequence_insert(banker, 0, process);
+		return 1;
+	}
+	sequence_insert(banker, banker->seq_len, process);
+	if (prefix_safe(banker, banker->seq_len - 1))
+		return 1;
+	sequence_remove(banker, banker->seq_len - 1);
+	return 0;
+}
+
+/* Check that the processes in sequence[0..last] can each finish in
+   turn. Those after last are unaffected by a request from sequence[last],
+   since by then it has released what it was given. */
+static int prefix_safe(banker_t *banker, int last) {
+	int *work = banker->work;
+	int m = banker->num_types;
+	int j;
+
+	memcpy(work, banker->available, m * sizeof(int));
+	for (j = 0; j <= last; j++) {
+		int process = banker->sequence[j];
+		if (!vec_le(ROW(banker, need, process), work, m))
+			return 0;
+		vec_add(work, ROW(banker, allocation, process), m);
+	}
+	return 1;
+}
+
+/* The textbook safety algorithm over the admitted processes, plus extra
+   if it isn't -1. On success the sequence it finds replaces the current
+   one. */
+static int full_safe(banker_t *banker, int extra) {
+	int *work = banker->work;
+	int *order = malloc((banker->seq_len + 1) * sizeof(int));
+	int total = banker->seq_len + (extra != -1);
+	int done = 0;
+	int progress = 1;
+	int j;
+
+	if (order == NULL)
+		return 0;
+	memcpy(order, banker->sequence, banker->seq_len * sizeof(int));
+	if (extra != -1)
+		order[banker->seq_len] = extra;
+	memcpy(work, banker->available, banker->num_types * sizeof(int));
+
+	/* Each pass finishes every process that can; the sequence built is
+	   written over the start of order as it grows */
+	while (done < total && progress) {
+		progress = 0;
+		for (j = done; j < total; j++) {
+			int process = order[j];
+			if (!vec_le(ROW(banker, need, process), work, banker->num_types))
+				continue;
+			vec_add(work, ROW(banker, allocation, process), banker->num_types);
+			order[j] = order[done];
+			order[done++] = process;
+			progress = 1;
+		}
+	}
+	if (done < total) {
+		free(order);
+		return 0;
+	}
+	memcpy(banker->sequence, order, total * sizeof(int));
+	banker->seq_len = total;
+	for (j = 0; j < total; j++) {
+		banker->position[banker->sequence[j]] = j;
+	}
+	free(order);
+	return 1;
+}
+
+static void sequence_insert(banker_t *banker, int index, int process) {
+	int j;
+
+	memmove(&banker->sequence[index + 1], &banker->sequence[index],
+			(banker->seq_len - index) * sizeof(int));
+	banker->sequence[index] = process;
+	banker->seq_len++;
+	for (j = index; j < banker->seq_len; j++) {
+		banker->position[banker->sequence[j]] = j;
+	}
+}
+
+static void sequence_remove(banker_t *banker, int index) {
+	int j;
+
+	banker->position[banker->sequence[index]] = -1;
+	memmove(&banker->sequence[index], &banker->sequence[index + 1],
+			(banker->seq_len - index - 1) * sizeof(int));
+	banker->seq_len--;
+	for (j = index; j < banker->seq_len; j++) {
+		banker->position[banker->sequence[j]] = j;
+	}
+}
@@ -0,0 +1,44 @@
+#ifndef BANKER_H
+#define BANKER_H
+
+/* Banker's algorithm over a fixed set of processes.
+ *
+ * Each process declares a maximum claim up front. It is admitted with
+ * its first request, after which it may request more, up to that claim,
+ * and finally releases everything. A request is only granted if it
+ * leaves the system in a safe state.
+ *
+ * The state keeps a safe sequence of the admitted processes. Granting
+ * process p more resources only lowers the resources available until p
+ * finishes, so only the part of the sequence up to p has to be checked
+ * again. The full O(n^2 m) safety algorithm is only run when that quick
+ * check fails, and it then finds a new sequence if there is one.
+ */
+typedef struct banker_t {
+	int num_types;
+	int num_processes;
+	int *available;		/* per resource type */
+	int *max;		/* num_processes x num_types, row-major */
+	int *allocation;	/* num_processes x num_types */
+	int *need;		/* max - allocation */
+	int *sequence;		/* a safe order of the admitted processes */
+	int seq_len;
+	int *position;		/* of each process in sequence, -1 if not admitted */
+	int *work;		/* scratch for the safety checks */
+	long quick_checks;	/* requests settled without the full check */
+	long full_checks;	/* requests that needed the full check */
+} banker_t;
+
+#define BANKER_GRANTED 1
+#define BANKER_WAIT 0
+#define BANKER_INVALID -1	/* more than the process's remaining claim */
+
+int banker_init(banker_t *banker, int num_types, const int *total,
+				int num_processes);
+void banker_free(banker_t *banker);
+void banker_set_max(banker_t *banker, int process, const int *max);
+int banker_request(banker_t *banker, int process, const int *request);
+void banker_release(banker_t *banker, int process);
+int banker_is_safe(banker_t *banker);
+
+#endif
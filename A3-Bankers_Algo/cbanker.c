@@ -0,0 +1,346 @@
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cbanker.h"
+#include "vecops.h"
+
+#define LINE_INTS (64 / sizeof(int))
+
+#define ROW(cb, matrix, process) \
+	(&(cb)->matrix[(size_t) (process) * (cb)->stride])
+
+static void *alloc_lines(size_t size);
+static int enter(cbanker_t *cb, cbanker_slot_t *slot);
+static void leave(cbanker_slot_t *slot);
+static void lock_all(cbanker_t *cb);
+static void unlock_all(cbanker_t *cb);
+static int take(cbanker_t *cb, const int *request);
+static void put_back(cbanker_t *cb, const int *request, int count);
+static int slow_request(cbanker_t *cb, int process, const int *request);
+static int full_safe(cbanker_t *cb);
+static int holds_any(const int *row, int n);
+
+/* Set up a system with total instances of each resource type, all
+   available, and no claims. Returns -1 if out of memory. */
+int cbanker_init(cbanker_t *cb, int num_types, const int *total,
+				 int num_processes) {
+	size_t cells;
+
+	memset(cb, 0, sizeof(*cb));
+	pthread_mutex_init(&cb->lock, NULL);
+	pthread_mutex_init(&cb->wait_lock, NULL);
+	pthread_cond_init(&cb->released, NULL);
+	cb->num_types = num_types;
+	cb->num_processes = num_processes;
+	cb->stride = (num_types + LINE_INTS - 1) / LINE_INTS * LINE_INTS;
+	if (cb->stride == 0)
+		cb->stride = LINE_INTS;
+	cells = (size_t) cb->stride * num_processes;
+	cb->available = alloc_lines(cb->stride * sizeof(int));
+	cb->reserve = alloc_lines(cb->stride * sizeof(int));
+	cb->max = alloc_lines(cells * sizeof(int));
+	cb->allocation = alloc_lines(cells * sizeof(int));
+	cb->need = alloc_lines(cells * sizeof(int));
+	cb->slots = alloc_lines(num_processes * sizeof(cbanker_slot_t));
+	cb->work = malloc(num_types * sizeof(int));
+	cb->order = malloc(num_processes * sizeof(int));
+	if (cb->available == NULL || cb->reserve == NULL || cb->max == NULL ||
+		cb->allocation == NULL || cb->need == NULL || cb->slots == NULL ||
+		cb->work == NULL || cb->order == NULL) {
+		cbanker_free(cb);
+		return -1;
+	}
+	memcpy(cb->available, total, num_types * sizeof(int));
+	cb->lock_free = 1;
+	return 0;
+}
+
+void cbanker_free(cbanker_t *cb) {
+	pthread_mutex_destroy(&cb->lock);
+	pthread_mutex_destroy(&cb->wait_lock);
+	pthread_cond_destroy(&cb->released);
+	free(cb->available);
+	free(cb->reserve);
+	free(cb->max);
+	free(cb->allocation);
+	free(cb->need);
+	free(cb->slots);
+	free(cb->work);
+	free(cb->order);
+	memset(cb, 0, sizeof(*cb));
+}
+
+/* Declare the most a process will ever hold. Claims must all be set
+   before any thread makes a request, since they set the reserve. */
+void cbanker_set_max(cbanker_t *cb, int process, const int *max) {
+	int j;
+
+	memcpy(ROW(cb, max, process), max, cb->num_types * sizeof(int));
+	memcpy(ROW(cb, need, process), max, cb->num_types * sizeof(int));
+	for (j = 0; j < cb->num_types; j++) {
+		if (max[j] > cb->reserve[j])
+			cb->reserve[j] = max[j];
+	}
+}
+
+/* Ask for more resources for a process. Returns BANKER_GRANTED,
+   BANKER_WAIT if the resources aren't available or granting them would
+   be unsafe, or BANKER_INVALID if the request exceeds the process's
+   remaining claim. */
+int cbanker_request(cbanker_t *cb, int process, const int *request) {
+	cbanker_slot_t *slot = &cb->slots[process];
+	int *need = ROW(cb, need, process);
+	int result;
+
+	/* Only this thread changes the process's own rows */
+	if (!vec_le(request, need, cb->num_types))
+		return BANKER_INVALID;
+	if (cb->lock_free && enter(cb, slot)) {
+		int granted = take(cb, request);
+		if (granted) {
+			vec_add(ROW(cb, allocation, process), request, cb->num_types);
+			vec_sub(need, request, cb->num_types);
+		}
+		leave(slot);
+		if (granted) {
+			slot->fast_grants++;
+			return BANKER_GRANTED;
+		}
+	}
+	lock_all(cb);
+	result = slow_request(cb, process, request);
+	unlock_all(cb);
+	if (result == BANKER_GRANTED)
+		slot->slow_grants++;
+	return result;
+}
+
+/* As cbanker_request, but sleep until the request can be granted
+   instead of returning BANKER_WAIT */
+int cbanker_acquire(cbanker_t *cb, int process, const int *request) {
+	unsigned seen;
+	int result;
+
+	while (1) {
+		result = cbanker_request(cb, process, request);
+		if (result != BANKER_WAIT)
+			return result;
+		/* Count this one as waiting before trying again, so that any
+		   release either comes before the second try or wakes it */
+		__atomic_add_fetch(&cb->num_waiters, 1, __ATOMIC_SEQ_CST);
+		seen = __atomic_load_n(&cb->releases, __ATOMIC_SEQ_CST);
+		result = cbanker_request(cb, process, request);
+		if (result == BANKER_WAIT) {
+			cb->slots[process].waits++;
+			pthread_mutex_lock(&cb->wait_lock);
+			while (__atomic_load_n(&cb->releases, __ATOMIC_SEQ_CST) == seen)
+				pthread_cond_wait(&cb->released, &cb->wait_lock);
+			pthread_mutex_unlock(&cb->wait_lock);
+		}
+		__atomic_sub_fetch(&cb->num_waiters, 1, __ATOMIC_SEQ_CST);
+		if (result != BANKER_WAIT)
+			return result;
+	}
+}
+
+/* A process has finished: return everything it holds, and wake anyone
+   waiting for it. */
+void cbanker_release(cbanker_t *cb, int process) {
+	cbanker_slot_t *slot = &cb->slots[process];
+	int *allocation = ROW(cb, allocation, process);
+	int j;
+
+	if (cb->lock_free && enter(cb, slot)) {
+		for (j = 0; j < cb->num_types; j++) {
+			if (allocation[j] != 0)
+				__atomic_add_fetch(&cb->available[j], allocation[j],
+								   __ATOMIC_SEQ_CST);
+		}
+		memset(allocation, 0, cb->num_types * sizeof(int));
+		memcpy(ROW(cb, need, process), ROW(cb, max, process),
+			   cb->num_types * sizeof(int));
+		leave(slot);
+	} else {
+		lock_all(cb);
+		vec_add(cb->available, allocation, cb->num_types);
+		memset(allocation, 0, cb->num_types * sizeof(int));
+		memcpy(ROW(cb, need, process), ROW(cb, max, process),
+			   cb->num_types * sizeof(int));
+		unlock_all(cb);
+	}
+	if (__atomic_load_n(&cb->num_waiters, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&cb->wait_lock);
+		__atomic_add_fetch(&cb->releases, 1, __ATOMIC_SEQ_CST);
+		pthread_cond_broadcast(&cb->released);
+		pthread_mutex_unlock(&cb->wait_lock);
+	}
+}
+
+/* Check the current state from scratch, for testing. */
+int cbanker_is_safe(cbanker_t *cb) {
+	int safe;
+
+	lock_all(cb);
+	safe = full_safe(cb);
+	unlock_all(cb);
+	return safe;
+}
+
+/* Requests granted without and with the lock, and sleeps in
+   cbanker_acquire, over all processes. Only exact once the threads
+   using cb are done. */
+void cbanker_counts(cbanker_t *cb, long *fast, long *slow, long *waits) {
+	int i;
+
+	*fast = *slow = *waits = 0;
+	for (i = 0; i < cb->num_processes; i++) {
+		*fast += cb->slots[i].fast_grants;
+		*slow += cb->slots[i].slow_grants;
+		*waits += cb->slots[i].waits;
+	}
+}
+
+/* Zeroed memory starting on a cache line */
+static void *alloc_lines(size_t size) {
+	void *memory;
+
+	if (size == 0)
+		size = 64;
+	if (posix_memalign(&memory, 64, size) != 0)
+		return NULL;
+	memset(memory, 0, size);
+	return memory;
+}
+
+/* Flag that a process is in the lock-free path. Returns 0, unflagged,
+   if the full check is running or about to. Both sides store their
+   flag before looking at the other's, so one of them always sees the
+   other. */
+static int enter(cbanker_t *cb, cbanker_slot_t *slot) {
+	__atomic_store_n(&slot->busy, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&cb->exclusive, __ATOMIC_SEQ_CST))
+		return 1;
+	leave(slot);
+	return 0;
+}
+
+static void leave(cbanker_slot_t *slot) {
+	__atomic_store_n(&slot->busy, 0, __ATOMIC_RELEASE);
+}
+
+/* Take the lock and wait out the lock-free path, leaving the state to
+   the caller alone */
+static void lock_all(cbanker_t *cb) {
+	int i;
+
+	pthread_mutex_lock(&cb->lock);
+	if (!cb->lock_free)
+		return;
+	__atomic_store_n(&cb->exclusive, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i < cb->num_processes; i++) {
+		while (__atomic_load_n(&cb->slots[i].busy, __ATOMIC_SEQ_CST))
+			sched_yield();
+	}
+}
+
+static void unlock_all(cbanker_t *cb) {
+	__atomic_store_n(&cb->exclusive, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&cb->lock);
+}
+
+/* Take request from what is available if that leaves at least the
+   reserve of every type. Returns 0, having taken nothing, if not. Types
+   are taken one at a time, so others may briefly see less available
+   than there is and go to the full check for nothing. */
+static int take(cbanker_t *cb, const int *request) {
+	int j;
+
+	for (j = 0; j < cb->num_types; j++) {
+		int *available = &cb->available[j];
+		int left = __atomic_load_n(available, __ATOMIC_ACQUIRE);
+		do {
+			if (left - request[j] < cb->reserve[j]) {
+				put_back(cb, request, j);
+				return 0;
+			}
+		} while (request[j] != 0 &&
+				 !__atomic_compare_exchange_n(available, &left,
+											  left - request[j], 0,
+											  __ATOMIC_ACQ_REL,
+											  __ATOMIC_ACQUIRE));
+	}
+	return 1;
+}
+
+/* Undo the first count types taken by take */
+static void put_back(cbanker_t *cb, const int *request, int count) {
+	int j;
+
+	for (j = 0; j < count; j++) {
+		if (request[j] != 0)
+			__atomic_add_fetch(&cb->available[j], request[j],
+							   __ATOMIC_RELEASE);
+	}
+}
+
+/* The request, with the lock held and nothing else going on */
+static int slow_request(cbanker_t *cb, int process, const int *request) {
+	int *allocation = ROW(cb, allocation, process);
+	int *need = ROW(cb, need, process);
+	int m = cb->num_types;
+
+	if (!vec_le(request, cb->available, m))
+		return BANKER_WAIT;
+	/* Grant it for now, and take it back if the result is unsafe */
+	vec_move(cb->available, allocation, request, m);
+	vec_sub(need, request, m);
+	if (full_safe(cb))
+		return BANKER_GRANTED;
+	vec_move(allocation, cb->available, request, m);
+	vec_add(need, request, m);
+	return BANKER_WAIT;
+}
+
+/* The textbook safety algorithm over the processes holding anything.
+   Those holding nothing can wait without getting in anyone's way. */
+static int full_safe(cbanker_t *cb) {
+	int *work = cb->work;
+	int *order = cb->order;
+	int m = cb->num_types;
+	int total = 0;
+	int done = 0;
+	int progress = 1;
+	int i, j;
+
+	if (vec_le(cb->reserve, cb->available, m))
+		return 1;
+	for (i = 0; i < cb->num_processes; i++) {
+		if (holds_any(ROW(cb, allocation, i), m))
+			order[total++] = i;
+	}
+	memcpy(work, cb->available, m * sizeof(int));
+	/* Each pass finishes every process that can */
+	while (done < total && progress) {
+		progress = 0;
+		for (j = done; j < total; j++) {
+			int process = order[j];
+			if (!vec_le(ROW(cb, need, process), work, m))
+				continue;
+			vec_add(work, ROW(cb, allocation, process), m);
+			order[j] = order[done];
+			order[done++] = process;
+			progress = 1;
+		}
+	}
+	return done == total;
+}
+
+static int holds_any(const int *row, int n) {
+	int j;
+
+	for (j = 0; j < n; j++) {
+		if (row[j] != 0)
+			return 1;
+	}
+	return 0;
+}
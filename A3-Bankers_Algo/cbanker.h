@@ -0,0 +1,67 @@
+#ifndef CBANKER_H
+#define CBANKER_H
+
+#include <pthread.h>
+#include "banker.h"
+
+/* Banker's algorithm shared by many threads, each driving one or more
+ * processes. A process must only be used by one thread at a time.
+ *
+ * Any state in which what is available covers the largest claim of
+ * every process, on every resource type, is safe: whichever process
+ * asks, it can finish. So a request that leaves at least that much
+ * (the reserve) available is granted straight away, by taking it from
+ * the available counts with compare-and-swap, without any lock. Every
+ * other request, and a release while one is being looked at, takes the
+ * lock and runs the full safety check.
+ *
+ * The full check needs a still picture, so it first raises exclusive
+ * and waits for the requests and releases already in the lock-free
+ * path to finish. Each process flags when it is in that path, on a
+ * cache line of its own; one that finds exclusive raised takes the
+ * lock instead.
+ */
+
+/* Per process, each on its own cache line */
+typedef struct cbanker_slot_t {
+	int busy;		/* in the lock-free path */
+	long fast_grants;
+	long slow_grants;
+	long waits;		/* times cbanker_acquire had to sleep */
+} __attribute__((aligned(64))) cbanker_slot_t;
+
+typedef struct cbanker_t {
+	int num_types;
+	int num_processes;
+	int stride;		/* ints per row, a whole number of cache lines */
+	int *available;		/* per resource type */
+	int *reserve;		/* largest claim on each type */
+	int *max;		/* num_processes rows */
+	int *allocation;
+	int *need;		/* max - allocation */
+	cbanker_slot_t *slots;
+	int lock_free;		/* 0 to take the lock for everything */
+
+	pthread_mutex_t lock;	/* held for the full check */
+	int exclusive;		/* raised while it runs */
+	int *work;		/* scratch for the full check */
+	int *order;
+
+	/* Sleeping in cbanker_acquire until something is released */
+	pthread_mutex_t wait_lock;
+	pthread_cond_t released;
+	int num_waiters;
+	unsigned releases;
+} cbanker_t;
+
+int cbanker_init(cbanker_t *cb, int num_types, const int *total,
+				 int num_processes);
+void cbanker_free(cbanker_t *cb);
+void cbanker_set_max(cbanker_t *cb, int process, const int *max);
+int cbanker_request(cbanker_t *cb, int process, const int *request);
+int cbanker_acquire(cbanker_t *cb, int process, const int *request);
+void cbanker_release(cbanker_t *cb, int process);
+int cbanker_is_safe(cbanker_t *cb);
+void cbanker_counts(cbanker_t *cb, long *fast, long *slow, long *waits);
+
+#endif
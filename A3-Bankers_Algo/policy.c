@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <string.h>
+#include "policy.h"
+#include "simulation.h"
+
+static double rank_arrival(simulation_t *sim, process_t *process);
+static double rank_shortest(simulation_t *sim, process_t *process);
+static double rank_largest(simulation_t *sim, process_t *process);
+static double rank_best_fit(simulation_t *sim, process_t *process);
+static int compare_ranked(const void *a, const void *b);
+
+const policy_t policies[] = {
+	{ "input", "in the order the processes were given", NULL, 0 },
+	{ "fcfs", "earliest arrival first", rank_arrival, 0 },
+	{ "sjf", "shortest remaining run time first", rank_shortest, 0 },
+	{ "largest", "largest dominant share of the request first",
+	  rank_largest, 0 },
+	{ "bestfit", "tightest fit on the dominant resource of what is "
+	  "available first", rank_best_fit, 1 },
+};
+
+const int num_policies = sizeof(policies) / sizeof(policies[0]);
+
+/* The policy called name, or NULL if there isn't one */
+const policy_t *find_policy(const char *name) {
+	int i;
+
+	for (i = 0; i < num_policies; i++) {
+		if (strcmp(policies[i].name, name) == 0)
+			return &policies[i];
+	}
+	return NULL;
+}
+
+/* Rank candidates and sort them into the order the simulation's policy
+   offers them resources. They must be in input order to start with. */
+void policy_order(simulation_t *sim, ranked_t *candidates, int count) {
+	int i;
+
+	if (sim->policy == NULL || sim->policy->rank == NULL)
+		return;
+	for (i = 0; i < count; i++) {
+		candidates[i].rank =
+			sim->policy->rank(sim, &sim->processes[candidates[i].process]);
+	}
+	qsort(candidates, count, sizeof(ranked_t), compare_ranked);
+}
+
+/* The request a process is asking for now */
+static int *pending_request(process_t *process) {
+	if (process->start_time == -1)
+		return process->steps[0].request;
+	return process->steps[process->next_step].request;
+}
+
+static double rank_arrival(simulation_t *sim, process_t *process) {
+	return process->arrival_time;
+}
+
+static double rank_shortest(simulation_t *sim, process_t *process) {
+	return process->simulation_time - process->run_time;
+}
+
+/* The largest fraction of any resource type's instances asked for,
+   negated so the largest goes first */
+static double rank_largest(simulation_t *sim, process_t *process) {
+	int *request = pending_request(process);
+	double dominant = 0;
+	int j;
+
+	for (j = 0; j < sim->num_resource_types; j++) {
+		int total = sim->num_each_resource_type[j];
+		if (total > 0 && (double) request[j] / total > dominant)
+			dominant = (double) request[j] / total;
+	}
+	return -dominant;
+}
+
+/* The largest fraction of what is available of any type asked for,
+   negated so the tightest fit goes first. Requests that don't fit at
+   all go last. */
+static double rank_best_fit(simulation_t *sim, process_t *process) {
+	int *request = pending_request(process);
+	int *available = sim->banker.available;
+	double dominant = 0;
+	int j;
+
+	for (j = 0; j < sim->num_resource_types; j++) {
+		if (request[j] == 0)
+			continue;
+		if (request[j] > available[j])
+			return 1;
+		if ((double) request[j] / available[j] > dominant)
+			dominant = (double) request[j] / available[j];
+	}
+	return -dominant;
+}
+
+static int compare_ranked(const void *a, const void *b) {
+	const ranked_t *x = a;
+	const ranked_t *y = b;
+
+	if (x->rank != y->rank)
+		return x->rank < y->rank ? -1 : 1;
+	return x->process - y->process;
+}
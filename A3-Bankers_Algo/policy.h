@@ -0,0 +1,32 @@
+#ifndef POLICY_H
+#define POLICY_H
+
+struct simulation_t;
+struct process_t;
+
+/* The order in which processes asking for resources are offered them,
+   when several ask at the same time. Each process gets a rank, and
+   lower ranks go first, ties in input order. */
+typedef struct policy_t {
+	const char *name;
+	const char *description;
+	/* NULL keeps input order */
+	double (*rank)(struct simulation_t *sim, struct process_t *process);
+	/* Ranks depend on what is available, so the rest are ranked again
+	   after each grant */
+	int rerank;
+} policy_t;
+
+/* A process waiting to be offered resources, with its rank */
+typedef struct ranked_t {
+	double rank;
+	int process;
+} ranked_t;
+
+extern const policy_t policies[];
+extern const int num_policies;
+
+const policy_t *find_policy(const char *name);
+void policy_order(struct simulation_t *sim, ranked_t *candidates, int count);
+
+#endif
@@ -0,0 +1,566 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "scenario.h"
+
+/* The binary form: this header, then the arrays of scenario_t in the
+   order of layout(), each starting on an 8 byte boundary. Numbers are
+   in the byte order of the machine that wrote it. */
+#define SCENARIO_MAGIC "BNKSCN01"
+
+typedef struct header_t {
+	char magic[8];
+	uint32_t num_types;
+	uint32_t num_processes;
+	uint32_t num_steps;
+	uint32_t unused;
+	uint64_t names_size;
+} header_t;
+
+#define NUM_SECTIONS 9
+
+/* Position in a text file being parsed */
+typedef struct cursor_t {
+	char *p;
+	char *end;
+	int line;
+} cursor_t;
+
+static int load_text(scenario_t *scenario, char *text, size_t size);
+static int load_binary(scenario_t *scenario);
+static int check(scenario_t *scenario);
+static size_t layout(const scenario_t *scenario, size_t *offsets,
+					 size_t *sizes);
+static int fail(scenario_t *scenario, const char *format, ...);
+static void skip_blank(cursor_t *c);
+static int skip_empty_lines(cursor_t *c);
+static int end_of_line(cursor_t *c);
+static int parse_number(cursor_t *c, long *value);
+static char *parse_word(cursor_t *c);
+
+/* Load a scenario from a file in either form. Returns -1 with a
+   message in scenario->error if it can't be read or isn't valid. */
+int scenario_load(scenario_t *scenario, const char *path) {
+	struct stat st;
+	int fd;
+	int result;
+
+	memset(scenario, 0, sizeof(*scenario));
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return fail(scenario, "%s", strerror(errno));
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		close(fd);
+		return fail(scenario, "empty file");
+	}
+	/* Names are offsets into the file, so they have to fit in 32 bits */
+	if ((uint64_t) st.st_size > UINT32_MAX) {
+		close(fd);
+		return fail(scenario, "file too large");
+	}
+	/* Private and writable, so names can be terminated in place */
+	scenario->map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+						 MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (scenario->map == MAP_FAILED) {
+		scenario->map = NULL;
+		return fail(scenario, "%s", strerror(errno));
+	}
+	scenario->map_size = st.st_size;
+
+	if (scenario->map_size >= sizeof(header_t) &&
+		memcmp(scenario->map, SCENARIO_MAGIC, 8) == 0)
+		result = load_binary(scenario);
+	else
+		result = load_text(scenario, scenario->map, scenario->map_size);
+	if (result == 0)
+		result = check(scenario);
+	if (result != 0) {
+		char error[sizeof(scenario->error)];
+		memcpy(error, scenario->error, sizeof(error));
+		scenario_free(scenario);
+		memcpy(scenario->error, error, sizeof(error));
+	}
+	return result;
+}
+
+/* Write a scenario in the binary form. Names are packed together, so a
+   scenario read from text doesn't carry the rest of the text along. */
+int scenario_save(const scenario_t *scenario, const char *path) {
+	static const char zeros[8];
+	scenario_t packed = *scenario;
+	size_t offsets[NUM_SECTIONS + 1];
+	size_t sizes[NUM_SECTIONS];
+	const void *data[NUM_SECTIONS];
+	header_t header;
+	size_t written = sizeof(header);
+	FILE *file;
+	int i;
+
+	packed.names_size = 0;
+	for (i = 0; i < scenario->num_processes; i++) {
+		packed.names_size += strlen(scenario->names +
+									scenario->name_at[i]) + 1;
+	}
+	layout(&packed, offsets, sizes);
+
+	file = fopen(path, "wb");
+	if (file == NULL)
+		return -1;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, SCENARIO_MAGIC, 8);
+	header.num_types = scenario->num_types;
+	header.num_processes = scenario->num_processes;
+	header.num_steps = scenario->num_steps;
+	header.names_size = packed.names_size;
+	fwrite(&header, sizeof(header), 1, file);
+
+	data[0] = scenario->total;
+	data[1] = scenario->claims;
+	data[2] = scenario->arrival;
+	data[3] = scenario->length;
+	data[4] = NULL;		/* name_at, rebuilt below */
+	data[5] = scenario->first_step;
+	data[6] = scenario->step_offset;
+	data[7] = scenario->step_request;
+	data[8] = NULL;		/* names */
+	for (i = 0; i < NUM_SECTIONS; i++) {
+		int j;
+
+		fwrite(zeros, 1, offsets[i] - written, file);
+		written = offsets[i] + sizes[i];
+		if (data[i] != NULL) {
+			fwrite(data[i], 1, sizes[i], file);
+		} else if (i == 4) {
+			uint32_t at = 0;
+			for (j = 0; j < scenario->num_processes; j++) {
+				fwrite(&at, sizeof(at), 1, file);
+				at += strlen(scenario->names + scenario->name_at[j]) + 1;
+			}
+		} else {
+			for (j = 0; j < scenario->num_processes; j++) {
+				const char *name = scenario->names + scenario->name_at[j];
+				fwrite(name, 1, strlen(name) + 1, file);
+			}
+		}
+	}
+	if (fclose(file) != 0)
+		return -1;
+	return 0;
+}
+
+/* Allocate the arrays for a scenario of the given size in one block,
+   with room for names_size bytes of names if that isn't 0. Everything
+   starts zeroed, with no steps used yet. Returns -1 if out of memory. */
+int scenario_alloc(scenario_t *scenario, int num_types, int num_processes,
+				   size_t max_steps, size_t names_size) {
+	size_t n = num_processes;
+	size_t cells = n * num_types;
+	char *block;
+
+	/* The 8 byte arrays first, to keep everything aligned */
+	block = calloc(1, 8 * (2 * n + max_steps) +
+				   4 * (num_types + cells + n + n + 1 +
+						max_steps * num_types) + names_size);
+	if (block == NULL)
+		return -1;
+	scenario->block = block;
+	scenario->num_types = num_types;
+	scenario->num_processes = num_processes;
+	scenario->num_steps = 0;
+	scenario->arrival = (int64_t *) block;
+	scenario->length = scenario->arrival + n;
+	scenario->step_offset = scenario->length + n;
+	scenario->total = (int32_t *) (scenario->step_offset + max_steps);
+	scenario->claims = scenario->total + num_types;
+	scenario->name_at = (uint32_t *) (scenario->claims + cells);
+	scenario->first_step = scenario->name_at + n;
+	scenario->step_request = (int32_t *) (scenario->first_step + n + 1);
+	if (names_size > 0) {
+		scenario->names = (char *) (scenario->step_request +
+									max_steps * num_types);
+		scenario->names_size = names_size;
+	}
+	return 0;
+}
+
+void scenario_free(scenario_t *scenario) {
+	if (scenario->map != NULL)
+		munmap(scenario->map, scenario->map_size);
+	free(scenario->block);
+	memset(scenario, 0, sizeof(*scenario));
+}
+
+/* Parse the text form in place. The arrays are sized from the header
+   and a count of the ':' in the file, which bounds the number of
+   steps, and allocated in one block; nothing is allocated per process.
+   Names are terminated where they are in the file. */
+static int load_text(scenario_t *scenario, char *text, size_t size) {
+	cursor_t c = { text, text + size, 1 };
+	cursor_t totals;
+	size_t max_steps;
+	char *colon;
+	long value;
+	int m, n, i, j;
+
+	/* Number of resource types */
+	if (!skip_empty_lines(&c) || !parse_number(&c, &value) ||
+		value <= 0 || value > INT_MAX || !end_of_line(&c))
+		return fail(scenario, "line %d: expected the number of resource "
+					"types", c.line);
+	m = scenario->num_types = value;
+
+	/* Their names, which the simulation doesn't use */
+	skip_empty_lines(&c);
+	for (j = 0; j < m; j++) {
+		if (parse_word(&c) == NULL)
+			return fail(scenario, "line %d: expected %d resource names",
+						c.line, m);
+	}
+	if (!end_of_line(&c))
+		return fail(scenario, "line %d: expected %d resource names",
+					c.line, m);
+
+	/* Instances of each, read into place once the block exists */
+	skip_empty_lines(&c);
+	totals = c;
+	for (j = 0; j < m; j++) {
+		if (!parse_number(&c, &value))
+			return fail(scenario, "line %d: expected %d resource counts",
+						c.line, m);
+	}
+	if (!end_of_line(&c))
+		return fail(scenario, "line %d: expected %d resource counts",
+					c.line, m);
+
+	/* Number of processes */
+	if (!skip_empty_lines(&c) || !parse_number(&c, &value) ||
+		value <= 0 || value > INT_MAX || (size_t) value > size ||
+		!end_of_line(&c))
+		return fail(scenario, "line %d: expected the number of processes",
+					c.line);
+	n = scenario->num_processes = value;
+
+	max_steps = n;
+	for (colon = c.p; colon != NULL && colon < c.end; colon++) {
+		colon = memchr(colon, ':', c.end - colon);
+		if (colon == NULL)
+			break;
+		max_steps++;
+	}
+	if (max_steps > UINT32_MAX)
+		return fail(scenario, "too many steps");
+
+	if (scenario_alloc(scenario, m, n, max_steps, 0) != 0)
+		return fail(scenario, "out of memory");
+	scenario->names = text;
+	scenario->names_size = size;
+
+	for (j = 0; j < m; j++) {
+		parse_number(&totals, &value);
+		if (value < INT32_MIN || value > INT32_MAX)
+			return fail(scenario, "line %d: resource count out of range",
+						totals.line);
+		scenario->total[j] = value;
+	}
+
+	for (i = 0; i < n; i++) {
+		int32_t *claim = &scenario->claims[(size_t) i * m];
+		uint32_t first = scenario->num_steps;
+		char *name;
+
+		if (!skip_empty_lines(&c))
+			return fail(scenario, "expected %d processes, found %d", n, i);
+		name = parse_word(&c);
+		if (c.p == c.end || (*c.p != ' ' && *c.p != '\t'))
+			return fail(scenario, "line %d: expected a name, %d resource "
+						"counts, an arrival time and a length", c.line, m);
+		*c.p++ = '\0';
+		scenario->name_at[i] = name - text;
+		scenario->first_step[i] = first;
+
+		for (j = 0; j < m; j++) {
+			if (!parse_number(&c, &value) || value < INT32_MIN ||
+				value > INT32_MAX)
+				return fail(scenario, "line %d: expected %d resource "
+							"counts", c.line, m);
+			claim[j] = value;
+		}
+		if (!parse_number(&c, &value))
+			return fail(scenario, "line %d: expected an arrival time",
+						c.line);
+		scenario->arrival[i] = value;
+		if (!parse_number(&c, &value))
+			return fail(scenario, "line %d: expected a length", c.line);
+		scenario->length[i] = value;
+
+		/* Requests made while running, offset:count,count,... */
+		while (!end_of_line(&c)) {
+			uint32_t k = scenario->num_steps;
+			int32_t *request;
+
+			if (!parse_number(&c, &value) || c.p == c.end || *c.p != ':')
+				return fail(scenario, "line %d: expected "
+							"offset:count,count,...", c.line);
+			c.p++;
+			/* The first request is made on starting, even if empty */
+			if (k == first && value != 0) {
+				scenario->step_offset[k++] = 0;
+				scenario->num_steps++;
+			}
+			scenario->step_offset[k] = value;
+			request = &scenario->step_request[(size_t) k * m];
+			for (j = 0; j < m; j++) {
+				if (j > 0) {
+					if (c.p == c.end || *c.p != ',')
+						return fail(scenario, "line %d: expected %d counts "
+									"in each request", c.line, m);
+					c.p++;
+				}
+				if (c.p == c.end || *c.p == ' ' || *c.p == '\t' ||
+					!parse_number(&c, &value) || value < INT32_MIN ||
+					value > INT32_MAX)
+					return fail(scenario, "line %d: expected %d counts "
+								"in each request", c.line, m);
+				request[j] = value;
+			}
+			scenario->num_steps++;
+		}
+		/* No requests given: the whole claim at the start */
+		if (scenario->num_steps == first) {
+			memcpy(&scenario->step_request[(size_t) first * m], claim,
+				   m * sizeof(int32_t));
+			scenario->num_steps++;
+		}
+	}
+	scenario->first_step[n] = scenario->num_steps;
+	if (skip_empty_lines(&c))
+		return fail(scenario, "line %d: more than %d processes", c.line, n);
+	return 0;
+}
+
+/* Point the arrays into the mapped file, after checking it is as big
+   as its header says. */
+static int load_binary(scenario_t *scenario) {
+	header_t *header = scenario->map;
+	size_t offsets[NUM_SECTIONS + 1];
+	size_t sizes[NUM_SECTIONS];
+	char *base = scenario->map;
+
+	if (header->num_types == 0 || header->num_types > INT_MAX ||
+		header->num_processes == 0 || header->num_processes > INT_MAX ||
+		header->num_steps > INT_MAX ||
+		header->names_size > scenario->map_size ||
+		(uint64_t) header->num_types * header->num_processes >
+		scenario->map_size ||
+		(uint64_t) header->num_types * header->num_steps >
+		scenario->map_size)
+		return fail(scenario, "bad header");
+	scenario->num_types = header->num_types;
+	scenario->num_processes = header->num_processes;
+	scenario->num_steps = header->num_steps;
+	scenario->names_size = header->names_size;
+	if (layout(scenario, offsets, sizes) != scenario->map_size)
+		return fail(scenario, "wrong size for its header");
+
+	scenario->total = (int32_t *) (base + offsets[0]);
+	scenario->claims = (int32_t *) (base + offsets[1]);
+	scenario->arrival = (int64_t *) (base + offsets[2]);
+	scenario->length = (int64_t *) (base + offsets[3]);
+	scenario->name_at = (uint32_t *) (base + offsets[4]);
+	scenario->first_step = (uint32_t *) (base + offsets[5]);
+	scenario->step_offset = (int64_t *) (base + offsets[6]);
+	scenario->step_request = (int32_t *) (base + offsets[7]);
+	scenario->names = base + offsets[8];
+	if (scenario->names_size == 0 ||
+		scenario->names[scenario->names_size - 1] != '\0')
+		return fail(scenario, "names not terminated");
+	return 0;
+}
+
+/* The rules the interactive prompts enforce, for either form. Also
+   makes sure a binary file can't point outside itself. */
+static int check(scenario_t *scenario) {
+	int m = scenario->num_types;
+	int i, j;
+	uint32_t k;
+
+	for (j = 0; j < m; j++) {
+		if (scenario->total[j] < 0)
+			return fail(scenario, "cannot have a negative number of "
+						"resources");
+	}
+	if (scenario->first_step[0] != 0 ||
+		scenario->first_step[scenario->num_processes] != scenario->num_steps)
+		return fail(scenario, "bad step index");
+	for (i = 0; i < scenario->num_processes; i++) {
+		const int32_t *claim = &scenario->claims[(size_t) i * m];
+		uint32_t first = scenario->first_step[i];
+		uint32_t last = scenario->first_step[i + 1];
+		const char *name;
+
+		if (scenario->name_at[i] >= scenario->names_size || last <= first ||
+			last > (uint32_t) scenario->num_steps)
+			return fail(scenario, "process %d: bad index", i + 1);
+		name = scenario->names + scenario->name_at[i];
+
+		for (j = 0; j < m; j++) {
+			if (claim[j] < 0 || claim[j] > scenario->total[j])
+				return fail(scenario, "process %d (%s): claim must be "
+							"between 0 and the instances of each resource",
+							i + 1, name);
+		}
+		if (scenario->arrival[i] < 0)
+			return fail(scenario, "process %d (%s): negative arrival time",
+						i + 1, name);
+		if (scenario->length[i] <= 0)
+			return fail(scenario, "process %d (%s): length must be "
+						"positive", i + 1, name);
+
+		if (scenario->step_offset[first] != 0)
+			return fail(scenario, "process %d (%s): no request on starting",
+						i + 1, name);
+		for (k = first; k < last; k++) {
+			if (scenario->step_offset[k] >= scenario->length[i] ||
+				(k > first &&
+				 scenario->step_offset[k] <= scenario->step_offset[k - 1]))
+				return fail(scenario, "process %d (%s): requests must be in "
+							"order and before the end", i + 1, name);
+		}
+		/* Can't ask for more than the claim, in total */
+		for (j = 0; j < m; j++) {
+			long total = 0;
+			for (k = first; k < last; k++) {
+				int32_t count = scenario->step_request[(size_t) k * m + j];
+				if (count < 0)
+					return fail(scenario, "process %d (%s): negative "
+								"request", i + 1, name);
+				total += count;
+			}
+			if (total > claim[j])
+				return fail(scenario, "process %d (%s): requests add up to "
+							"more than the claim", i + 1, name);
+		}
+	}
+	return 0;
+}
+
+/* Where each array starts in the binary form and its size, given the
+   counts and names_size. offsets gets NUM_SECTIONS + 1 entries, the
+   last being the end of the names, which is also returned. */
+static size_t layout(const scenario_t *scenario, size_t *offsets,
+					 size_t *sizes) {
+	size_t n = scenario->num_processes;
+	size_t cells = n * scenario->num_types;
+	size_t steps = scenario->num_steps;
+	size_t pos = sizeof(header_t);
+	int i;
+
+	sizes[0] = scenario->num_types * sizeof(int32_t);
+	sizes[1] = cells * sizeof(int32_t);
+	sizes[2] = n * sizeof(int64_t);
+	sizes[3] = n * sizeof(int64_t);
+	sizes[4] = n * sizeof(uint32_t);
+	sizes[5] = (n + 1) * sizeof(uint32_t);
+	sizes[6] = steps * sizeof(int64_t);
+	sizes[7] = steps * scenario->num_types * sizeof(int32_t);
+	sizes[8] = scenario->names_size;
+	for (i = 0; i < NUM_SECTIONS; i++) {
+		pos = (pos + 7) & ~(size_t) 7;
+		offsets[i] = pos;
+		pos += sizes[i];
+	}
+	offsets[NUM_SECTIONS] = pos;
+	return pos;
+}
+
+static int fail(scenario_t *scenario, const char *format, ...) {
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(scenario->error, sizeof(scenario->error), format, args);
+	va_end(args);
+	return -1;
+}
+
+static void skip_blank(cursor_t *c) {
+	while (c->p < c->end && (*c->p == ' ' || *c->p == '\t' || *c->p == '\r'))
+		c->p++;
+}
+
+/* Move to the start of the next line with something on it. Returns 0
+   at the end of the file. */
+static int skip_empty_lines(cursor_t *c) {
+	while (1) {
+		skip_blank(c);
+		if (c->p == c->end)
+			return 0;
+		if (*c->p == '#') {
+			char *eol = memchr(c->p, '\n', c->end - c->p);
+			c->p = eol != NULL ? eol : c->end;
+		}
+		if (c->p < c->end && *c->p == '\n') {
+			c->p++;
+			c->line++;
+			continue;
+		}
+		return c->p < c->end;
+	}
+}
+
+/* Whether nothing is left on this line, moving past its end if so */
+static int end_of_line(cursor_t *c) {
+	skip_blank(c);
+	if (c->p == c->end)
+		return 1;
+	if (*c->p != '\n')
+		return 0;
+	c->p++;
+	c->line++;
+	return 1;
+}
+
+/* A decimal number, after any blanks on the same line */
+static int parse_number(cursor_t *c, long *value) {
+	int negative = 0;
+	long result = 0;
+	char *start;
+
+	skip_blank(c);
+	if (c->p < c->end && *c->p == '-') {
+		negative = 1;
+		c->p++;
+	}
+	start = c->p;
+	while (c->p < c->end && *c->p >= '0' && *c->p <= '9') {
+		int digit = *c->p - '0';
+		if (result > (LONG_MAX - digit) / 10)
+			return 0;
+		result = result * 10 + digit;
+		c->p++;
+	}
+	if (c->p == start)
+		return 0;
+	*value = negative ? -result : result;
+	return 1;
+}
+
+/* The next word on this line, not terminated, or NULL if there isn't
+   one */
+static char *parse_word(cursor_t *c) {
+	char *start;
+
+	skip_blank(c);
+	start = c->p;
+	while (c->p < c->end && *c->p != ' ' && *c->p != '\t' &&
+		   *c->p != '\r' && *c->p != '\n')
+		c->p++;
+	return c->p == start ? NULL : start;
+}
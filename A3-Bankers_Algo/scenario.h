@@ -0,0 +1,47 @@
+#ifndef SCENARIO_H
+#define SCENARIO_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A whole simulation input, loaded from a file in one go.
+ *
+ * The text form is exactly what the interactive prompts read, one
+ * answer per line: the number of resource types, their names, the
+ * instances of each, the number of processes and then one line per
+ * process. Blank lines and lines starting with # are skipped. The
+ * binary form holds the same arrays as below, so loading it is just
+ * mapping the file and pointing into it.
+ *
+ * Every process has at least one step, its request on starting. A
+ * process given no requests has its whole claim as that step, and one
+ * whose first request comes later gets an empty one. The steps of
+ * process i are first_step[i] up to first_step[i + 1].
+ */
+typedef struct scenario_t {
+	int num_types;
+	int num_processes;
+	int num_steps;
+	int32_t *total;		/* instances of each resource type */
+	int32_t *claims;	/* num_processes x num_types, row-major */
+	int64_t *arrival;	/* per process */
+	int64_t *length;
+	uint32_t *name_at;	/* offset of each name in names */
+	uint32_t *first_step;	/* num_processes + 1 */
+	int64_t *step_offset;	/* run time at which each request is made */
+	int32_t *step_request;	/* num_steps x num_types */
+	char *names;		/* NUL-terminated names */
+	size_t names_size;
+	void *map;		/* the file */
+	size_t map_size;
+	void *block;		/* the arrays, when they aren't in the file */
+	char error[160];
+} scenario_t;
+
+int scenario_load(scenario_t *scenario, const char *path);
+int scenario_save(const scenario_t *scenario, const char *path);
+int scenario_alloc(scenario_t *scenario, int num_types, int num_processes,
+				   size_t max_steps, size_t names_size);
+void scenario_free(scenario_t *scenario);
+
+#endif
@@ -1,57 +1,188 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include "simulation.h"
+#include "sweep.h"
+#include "trace.h"
+#include "vecops.h"
 
-typedef struct process_t {
-	char *name;
-	int *needed_resources;
-	int arrival_time;
-	int simulation_time;
-	int start_time;
-	int completed;
-} process_t;
-
-int num_resource_types;
-int *num_each_resource_type;
-int *avail_each_resource_type;
-int num_processes;
-process_t *processes;
-
-
-void get_resources();
-void get_processes();
-void run_simulation();
-int resources_available(process_t *process);
-void allocate_resources(process_t *process);
-void release_resources(process_t *process);
-int all_processes_completed();
-int is_deadlock(int simulation_time);
-int system_idle();
+void get_resources(simulation_t *sim);
+void get_processes(simulation_t *sim);
+int parse_steps(simulation_t *sim, process_t *process, char *ptr);
+void compare_policies(simulation_t *sim);
+void print_summary(simulation_t *sim);
+void trace_step(simulation_t *sim, long simulation_time);
+void trace_quiet_ticks(simulation_t *sim, long first, long last);
+void schedule_next(simulation_t *sim, int i);
+void push_event(simulation_t *sim, long time, int process, int type);
+event_t pop_event(simulation_t *sim);
+int event_before(event_t *a, event_t *b);
+void active_merge(simulation_t *sim);
+void active_remove(simulation_t *sim, int i);
+void asking_merge(simulation_t *sim);
+void asking_remove(simulation_t *sim, int i);
+void sort_by_type(simulation_t *sim);
+int demand_compare(const void *a, const void *b);
+int resources_available(simulation_t *sim, process_t *process);
+int all_processes_completed(simulation_t *sim);
+int is_deadlock(simulation_t *sim);
+int fitting(simulation_t *sim, int type);
+int system_idle(simulation_t *sim);
+
+const char *outcome_names[] = { "completed", "deadlock", "stuck" };
 
 int main(int argc, char* argv[]) {
-	get_resources();
-	get_processes();
-	run_simulation();
+	simulation_t simulation;
+	simulation_t *sim = &simulation;
+	scenario_t scenario;
+	char *in_path = NULL;
+	char *out_path = NULL;
+	char *sweep_spec = NULL;
+	char *policy = NULL;
+	trace_t trace;
+	int format = TRACE_TEXT;
+	int quiet = 0;
+	int threads = 0;
+	int ch, i;
+
+	memset(sim, 0, sizeof(*sim));
+	while ((ch = getopt(argc, argv, "cf:o:p:qs:t:w:")) != -1) {
+		if (ch == 'c') {
+			sim->compact_output = 1;
+		} else if (ch == 'f') {
+			in_path = optarg;
+		} else if (ch == 'o') {
+			format = trace_format(optarg);
+			if (format == -1) {
+				fprintf(stderr, "Unknown output format %s; one of text, "
+						"csv, jsonl and binary\n", optarg);
+				exit(1);
+			}
+		} else if (ch == 'q') {
+			quiet = 1;
+		} else if (ch == 'p') {
+			policy = optarg;
+		} else if (ch == 's') {
+			sweep_spec = optarg;
+		} else if (ch == 't') {
+			threads = atoi(optarg);
+		} else if (ch == 'w') {
+			out_path = optarg;
+		} else {
+			fprintf(stderr, "usage: %s [-c | -q] [-o format] "
+					"[-p policy|all] [-f scenario [-w binary]]\n"
+					"       %s -s spec [-t threads]\n", argv[0], argv[0]);
+			exit(1);
+		}
+	}
+	if (policy != NULL && strcmp(policy, "all") != 0) {
+		sim->policy = find_policy(policy);
+		if (sim->policy == NULL) {
+			fprintf(stderr, "Unknown policy %s; one of:\n", policy);
+			for (i = 0; i < num_policies; i++) {
+				fprintf(stderr, "  %-8s %s\n", policies[i].name,
+						policies[i].description);
+			}
+			exit(1);
+		}
+	}
+	if (sweep_spec != NULL)
+		return run_sweep(sweep_spec, threads) == 0 ? 0 : 1;
+	if (out_path != NULL && in_path == NULL) {
+		fprintf(stderr, "-w needs a scenario to convert, given with -f\n");
+		exit(1);
+	}
+	if (in_path != NULL) {
+		/* No prompts: everything comes from the file */
+		if (scenario_load(&scenario, in_path) != 0) {
+			fprintf(stderr, "%s: %s\n", in_path, scenario.error);
+			exit(1);
+		}
+		if (out_path != NULL) {
+			if (scenario_save(&scenario, out_path) != 0) {
+				perror(out_path);
+				exit(1);
+			}
+			return 0;
+		}
+		use_scenario(sim, &scenario);
+		/* The blank line the prompts would have ended with */
+		if (format == TRACE_TEXT && !quiet)
+			fprintf(stdout, "\n");
+	} else {
+		get_resources(sim);
+		get_processes(sim);
+	}
+	if (policy != NULL && strcmp(policy, "all") == 0) {
+		compare_policies(sim);
+	} else if (quiet) {
+		run_simulation(sim);
+		print_summary(sim);
+	} else {
+		if (trace_open(&trace, format, stdout, sim) != 0) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		sim->trace = &trace;
+		run_simulation(sim);
+		trace_close(&trace);
+		sim->trace = NULL;
+	}
+	if (in_path != NULL) {
+		free_simulation(sim);
+		scenario_free(&scenario);
+	}
 	return 0;
 }
 
-void get_resources() {
+/* Run the same processes under every policy, without the step by step
+   output, and print how each did */
+void compare_policies(simulation_t *sim) {
+	summary_t summary;
+	int i;
+
+	sim->trace = NULL;
+	fprintf(stdout, "%-8s %10s %10s %12s  %s\n", "policy", "makespan",
+			"avg wait", "utilization", "outcome");
+	for (i = 0; i < num_policies; i++) {
+		sim->policy = &policies[i];
+		run_simulation(sim);
+		summarize(sim, &summary);
+		fprintf(stdout, "%-8s %10ld %10.2f %11.1f%%  %s\n",
+				policies[i].name, summary.makespan, summary.average_wait,
+				100 * summary.utilization, outcome_names[summary.outcome]);
+	}
+}
+
+/* All that quiet mode prints, once the run is over */
+void print_summary(simulation_t *sim) {
+	summary_t summary;
+
+	summarize(sim, &summary);
+	fprintf(stdout, "?> Simulation %s at time %ld, average wait %.2f, "
+			"utilization %.1f%%\n", outcome_names[summary.outcome],
+			summary.makespan, summary.average_wait,
+			100 * summary.utilization);
+}
+
+void get_resources(simulation_t *sim) {
 	char buffer[80];
 	int i;
 	/* Loop until input is valid */
 	while (1) {
 		fprintf(stdout, "?> Number of different resource types: ");
 		fgets(buffer, sizeof(buffer), stdin);
-		num_resource_types = atoi(buffer);
+		sim->num_resource_types = atoi(buffer);
 		/* Check that we have a positive number */
-		if (num_resource_types > 0) {
+		if (sim->num_resource_types > 0) {
 			break;
 		} else {
 			fprintf(stdout, "Invalid input, try again\n");
 		}
 	}
-	num_each_resource_type = malloc(num_resource_types * sizeof(int));
-	avail_each_resource_type = malloc(num_resource_types * sizeof(int));
+	sim->num_each_resource_type = malloc(sim->num_resource_types *
+										 sizeof(int));
 
 	/* Loop until input is valid */
 	while (1) {
@@ -60,7 +191,7 @@ void get_resources() {
 		fprintf(stdout, "?> Names of each resource type: ");
 		fgets(buffer, sizeof(buffer), stdin);
 		/* Check count of values */
-		for (i = 0; i < num_resource_types; i++) {
+		for (i = 0; i < sim->num_resource_types; i++) {
 			if (i == 0)
 				ptr = strtok(buffer, " ");
 			else
@@ -90,7 +221,7 @@ void get_resources() {
 		fprintf(stdout, "?> Number of instances of each resource type: ");
 		fgets(buffer, sizeof(buffer), stdin);
 		/* Check count of values */
-		for (i = 0; i < num_resource_types; i++) {
+		for (i = 0; i < sim->num_resource_types; i++) {
 			if (i == 0)
 				ptr = strtok(buffer, " ");
 			else
@@ -101,7 +232,7 @@ void get_resources() {
 				pass = 0;
 				break;
 			}
-			num_each_resource_type[i] = atoi(ptr);
+			sim->num_each_resource_type[i] = atoi(ptr);
 		}
 		/* Check for too many words */
 		ptr = strtok(NULL, " ");
@@ -110,8 +241,8 @@ void get_resources() {
 			pass = 0;
 		}
 		/* Check that all resource counts are valid */
-		for (i = 0; i < num_resource_types; i++) {
-			if (num_each_resource_type[i] < 0) {
+		for (i = 0; i < sim->num_resource_types; i++) {
+			if (sim->num_each_resource_type[i] < 0) {
 				fprintf(stdout, "Cannot have a negative number of resources\n");
 				pass = 0;
 			}
@@ -123,30 +254,32 @@ void get_resources() {
 	fprintf(stdout, "\n");
 }
 
-void get_processes() {
-	char buffer[80];
+void get_processes(simulation_t *sim) {
+	char buffer[1024];
 	int i = 0;
 
 	/* Loop until input is valid */
 	while (1) {
 		fprintf(stdout, "?> Number of processes: ");
 		fgets(buffer, sizeof(buffer), stdin);
-		num_processes = atoi(buffer);
+		sim->num_processes = atoi(buffer);
 		/* Check that we have a positive number */
-		if (num_processes > 0) {
+		if (sim->num_processes > 0) {
 			break;
 		} else {
 			fprintf(stdout, "Invalid input, try again\n");
 		}
 	}
 	/* Allocate process structs */
-	processes = malloc(num_processes * sizeof(process_t));
-	memset(processes, 0, num_processes * sizeof(process_t));
+	sim->processes = malloc(sim->num_processes * sizeof(process_t));
+	memset(sim->processes, 0, sim->num_processes * sizeof(process_t));
+	sim->claims = malloc((size_t) sim->num_processes *
+						 sim->num_resource_types * sizeof(int));
 
 	/* Get info for each process */
-	for (i = 0; i < num_processes; i++) {
-		processes[i].needed_resources = malloc(num_resource_types *
-											   sizeof(int));
+	for (i = 0; i < sim->num_processes; i++) {
+		sim->processes[i].needed_resources =
+			&sim->claims[(size_t) i * sim->num_resource_types];
 		/* Loop until input is valid */
 		while (1) {
 			int j;
@@ -157,40 +290,47 @@ void get_processes() {
 
 			/* Get process name */
 			ptr = strtok(buffer, " ");
-			processes[i].name = malloc(strlen(ptr) * sizeof(char));
-			strcpy(processes[i].name, ptr);
+			sim->processes[i].name = malloc(strlen(ptr) + 1);
+			strcpy(sim->processes[i].name, ptr);
 
 			/* Get resource counts */
-			for (j = 0; j < num_resource_types; j++) {
+			for (j = 0; j < sim->num_resource_types; j++) {
 				ptr = strtok(NULL, " ");
-				processes[i].needed_resources[j] = atoi(ptr);
+				sim->processes[i].needed_resources[j] = atoi(ptr);
 				/* Do not allow negative numbers */
-				if (processes[i].needed_resources[j] < 0) {
+				if (sim->processes[i].needed_resources[j] < 0) {
 					pass = 0;
 				}
 				/* Do not allow processes that need more resources than the
 				   system contains */
-				if (processes[i].needed_resources[j] >
-					num_each_resource_type[j]) {
+				if (sim->processes[i].needed_resources[j] >
+					sim->num_each_resource_type[j]) {
 					pass = 0;
 				}
 			}
 
 			/* Get start time */
 			ptr = strtok(NULL, " ");
-			processes[i].arrival_time = atoi(ptr);
-			if (processes[i].arrival_time < 0) {
+			sim->processes[i].arrival_time = strtol(ptr, NULL, 10);
+			if (sim->processes[i].arrival_time < 0) {
 				pass = 0;
 			}
 
-			/* Get process length */
+			/* Get process length. A process that never ends would
+			   keep the simulation going forever. */
 			ptr = strtok(NULL, " ");
-			processes[i].simulation_time = atoi(ptr);
-			if (processes[i].simulation_time == 0) {
+			sim->processes[i].simulation_time = strtol(ptr, NULL, 10);
+			if (sim->processes[i].simulation_time <= 0) {
+				pass = 0;
+			}
+
+			/* Get any requests made while running */
+			if (pass == 1 && !parse_steps(sim, &sim->processes[i],
+										  strtok(NULL, " \n"))) {
 				pass = 0;
 			}
 
-			processes[i].start_time = -1;
+			sim->processes[i].start_time = -1;
 
 			if (pass == 1) {
 				break;
@@ -201,125 +341,617 @@ void get_processes() {
 	}
 }
 
-void run_simulation() {
-	int simulation_time = 0;
+/* Set up the processes from a loaded scenario. Names, claims and
+   requests stay where the loader put them. */
+void use_scenario(simulation_t *sim, scenario_t *scenario) {
+	step_t *steps;
+	int m = scenario->num_types;
+	int i;
+
+	sim->num_resource_types = m;
+	sim->num_each_resource_type = scenario->total;
+	sim->num_processes = scenario->num_processes;
+	sim->claims = scenario->claims;
+	sim->processes = calloc(sim->num_processes, sizeof(process_t));
+	steps = sim->steps = malloc(scenario->num_steps * sizeof(step_t));
+	for (i = 0; i < scenario->num_steps; i++) {
+		steps[i].offset = scenario->step_offset[i];
+		steps[i].request = &scenario->step_request[(size_t) i * m];
+	}
+	for (i = 0; i < sim->num_processes; i++) {
+		process_t *process = &sim->processes[i];
+		process->name = scenario->names + scenario->name_at[i];
+		process->needed_resources = &sim->claims[(size_t) i * m];
+		process->arrival_time = scenario->arrival[i];
+		process->simulation_time = scenario->length[i];
+		process->start_time = -1;
+		process->steps = &steps[scenario->first_step[i]];
+		process->num_steps = scenario->first_step[i + 1] -
+			scenario->first_step[i];
+	}
+}
+
+/* Read the optional requests after a process's length, each written
+   "offset:count,count,...", one count per resource type. offset is how
+   long the process has run when it asks. Without them, the process asks
+   for its whole claim on starting. Returns 0 if they are invalid. */
+int parse_steps(simulation_t *sim, process_t *process, char *ptr) {
+	int *total = calloc(sim->num_resource_types, sizeof(int));
+	int j;
+
+	process->num_steps = 0;
+	while (1) {
+		step_t *step;
+		char *end;
+		long offset;
+
+		if (ptr == NULL && process->num_steps > 0)
+			break;
+		if (ptr == NULL) {
+			/* No requests given: the whole claim at the start */
+			offset = 0;
+		} else {
+			offset = strtol(ptr, &end, 10);
+			if (*end != ':' || offset < 0 ||
+				offset >= process->simulation_time ||
+				(process->num_steps > 0 &&
+				 offset <= process->steps[process->num_steps - 1].offset)) {
+				free(total);
+				return 0;
+			}
+			ptr = end + 1;
+		}
+		/* The first request is made on starting, even if it's empty */
+		if (process->num_steps == 0 && offset > 0) {
+			process->steps = realloc(process->steps, sizeof(step_t));
+			process->steps[0].offset = 0;
+			process->steps[0].request = calloc(sim->num_resource_types,
+											   sizeof(int));
+			process->num_steps = 1;
+		}
+		process->steps = realloc(process->steps,
+								 (process->num_steps + 1) * sizeof(step_t));
+		step = &process->steps[process->num_steps++];
+		step->offset = offset;
+		if (ptr == NULL) {
+			/* The claim itself, no copy needed */
+			step->request = process->needed_resources;
+			break;
+		}
+		step->request = malloc(sim->num_resource_types * sizeof(int));
+		for (j = 0; j < sim->num_resource_types; j++) {
+			step->request[j] = strtol(ptr, &end, 10);
+			if (end == ptr ||
+				(*end != ',' && j < sim->num_resource_types - 1)) {
+				free(total);
+				return 0;
+			}
+			ptr = end + 1;
+			total[j] += step->request[j];
+			/* Can't ask for more than the claim, in total */
+			if (step->request[j] < 0 ||
+				total[j] > process->needed_resources[j]) {
+				free(total);
+				return 0;
+			}
+		}
+		ptr = strtok(NULL, " \n");
+	}
+	free(total);
+	return 1;
+}
+
+/* Run the simulation, one time step at a time. Time only moves on to
+   the next arrival or completion: nothing can change in between, so the
+   steps skipped all print the same lines, and are printed in one go. */
+void run_simulation(simulation_t *sim) {
+	long simulation_time = 0;
 	int i;
+	/* So the same processes can be run again */
+	for (i = 0; i < sim->num_processes; i++) {
+		process_t *process = &sim->processes[i];
+		process->start_time = -1;
+		process->completed = 0;
+		process->next_step = 0;
+		process->waiting = 0;
+		process->run_time = 0;
+		process->finish_time = -1;
+	}
 	/* All resources are available at start */
-	memcpy(avail_each_resource_type, num_each_resource_type,
-		   num_resource_types * sizeof(int));
+	banker_init(&sim->banker, sim->num_resource_types,
+				sim->num_each_resource_type, sim->num_processes);
+	for (i = 0; i < sim->num_processes; i++) {
+		banker_set_max(&sim->banker, i, sim->processes[i].needed_resources);
+	}
+	/* A process has at most its arrival and one other event pending */
+	sim->events = malloc(sim->num_processes * 2 * sizeof(event_t));
+	sim->num_events = 0;
+	for (i = 0; i < sim->num_processes; i++) {
+		push_event(sim, sim->processes[i].arrival_time, i, EVENT_ARRIVAL);
+	}
+	sim->arrivals = malloc(sim->num_processes * sizeof(int));
+	sim->askers = malloc(sim->num_processes * sizeof(int));
+	sim->candidates = malloc(sim->num_processes * sizeof(ranked_t));
+	sim->num_candidates = 0;
+	sort_by_type(sim);
+	sim->first_active = -1;
+	sim->first_asking = -1;
+	sim->num_running = sim->num_waiting = sim->num_completed = 0;
+	free(sim->busy);
+	sim->busy = calloc(sim->num_resource_types, sizeof(double));
+	sim->outcome = SIM_COMPLETED;
 	/* Loop until the simulation is complete */
 	while (1) {
-		fprintf(stdout, "\n");
-		fprintf(stdout, "?> Simulation time: %d\n", simulation_time);
+		int k;
+
+		if (sim->trace != NULL)
+			trace_event(sim->trace, TRACE_TICK, simulation_time, -1);
+		/* Those granted resources last time are just running now */
+		for (k = 0; k < sim->num_candidates; k++) {
+			process_t *process = &sim->processes[sim->candidates[k].process];
+			if (process->granted)
+				process->asked = 0;
+		}
+		sim->num_arrivals = 0;
+		sim->num_askers = 0;
 		/* Check if any process is completed before trying to start new
 		   processes */
-		for (i = 0; i < num_processes; i++) {
-			process_t *process = &processes[i];
-			if (simulation_time - process->start_time ==
-				process->simulation_time && process->start_time != -1) {
-				fprintf(stdout, "?> Process %s has just finished execution\n",
-					process->name);
-				release_resources(process);
+		while (sim->num_events > 0 && sim->events[0].time <= simulation_time) {
+			event_t event = pop_event(sim);
+			process_t *process = &sim->processes[event.process];
+			/* Events come out in index order, so these lists are
+			   too. They are merged in below. */
+			if (event.type == EVENT_ARRIVAL) {
+				sim->arrivals[sim->num_arrivals++] = event.process;
+				sim->askers[sim->num_askers++] = event.process;
+			} else if (event.type == EVENT_REQUEST) {
+				if (sim->trace != NULL)
+					trace_event(sim->trace, TRACE_REQUESTED, simulation_time,
+								event.process);
+				process->run_time = process->steps[process->next_step].offset;
+				process->waiting = 1;
+				sim->num_running--;
+				sim->num_waiting++;
+				sim->askers[sim->num_askers++] = event.process;
+			} else if (event.type == EVENT_COMPLETION) {
+				if (sim->trace != NULL)
+					trace_event(sim->trace, TRACE_FINISHED, simulation_time,
+								event.process);
+				banker_release(&sim->banker, event.process);
 				process->completed = 1;
+				process->finish_time = simulation_time;
+				sim->num_running--;
+				sim->num_completed++;
+				if (sim->trace != NULL)
+					active_remove(sim, event.process);
 			}
 		}
-		/* Try to start new processes */
-		for (i = 0; i < num_processes; i++) {
-			process_t *process = &processes[i];
-			/* Notify when process has arrived */
-			if (process->arrival_time == simulation_time) {
-				fprintf(stdout, "?> Process %s has just arrived "
-						"at the system\n", process->name);
-			}
-			
-			/* Check for running processes */
-			if (process->start_time != -1 && process->completed == 0) {
-				fprintf(stdout, "?> Process %s is running\n", process->name);
-			}
-			
-			/* Check if the process can be started */
-			if (process->arrival_time <= simulation_time &&
-				process->start_time == -1) {
-				if (resources_available(process)) {
-					/* resources are available - allocate them */
-					allocate_resources(process);
-					fprintf(stdout, "?> Process %s has just started "
-							"execution\n", process->name);
-					process->start_time = simulation_time;
-				} else {
-					/* resources are unavailable */
-					fprintf(stdout, "?> Process %s is idle\n", process->name);
-				}
+		if (sim->trace != NULL)
+			active_merge(sim);
+		/* Only processes asking for resources can change anything */
+		asking_merge(sim);
+		/* Offer them resources in the order of the policy */
+		policy_order(sim, sim->candidates, sim->num_candidates);
+		for (k = 0; k < sim->num_candidates; k++) {
+			process_t *process;
+			i = sim->candidates[k].process;
+			process = &sim->processes[i];
+			process->granted = banker_request(&sim->banker, i,
+					process->steps[process->next_step].request) ==
+				BANKER_GRANTED;
+			if (!process->granted)
+				continue;
+			asking_remove(sim, i);
+			if (process->asked == ASK_START) {
+				/* resources are available - allocate them */
+				process->start_time = simulation_time;
+				process->run_time = 0;
+			} else {
+				process->waiting = 0;
+				sim->num_waiting--;
 			}
+			sim->num_running++;
+			process->next_step++;
+			process->resumed_at = simulation_time;
+			schedule_next(sim, i);
+			if (sim->policy != NULL && sim->policy->rerank)
+				policy_order(sim, &sim->candidates[k + 1],
+							 sim->num_candidates - k - 1);
 		}
-		if (system_idle()) {
-			fprintf(stdout, "?> No processes running. System is idle\n");
-		}
-		if (all_processes_completed()) {
-			fprintf(stdout, "?> No processes available for execution\n\n"
-					"?> Simulation is ended.\n");
+		/* Report what each one did, in input order */
+		if (sim->trace != NULL)
+			trace_step(sim, simulation_time);
+		if (all_processes_completed(sim)) {
+			break;
+		} else if (is_deadlock(sim)) {
+			sim->outcome = SIM_DEADLOCK;
 			break;
-		} else if (is_deadlock(simulation_time)) {
-			fprintf(stdout, "?> No process is running. Available resources are "
-					"not sufficient to run any idle process or to avoid "
-					"deadlocks. Aborting\n\n?> Simulation is ended\n");
+		}
+		/* Without a deadlock, something is still running or yet to
+		   arrive, so there is always a next event. Waiting processes
+		   don't count as running here, but the safe state means one of
+		   them would have been granted its request. */
+		if (sim->num_events == 0) {
+			sim->outcome = SIM_STUCK;
 			break;
 		}
-		simulation_time++;
+		if (!sim->compact_output && sim->trace != NULL)
+			trace_quiet_ticks(sim, simulation_time + 1, sim->events[0].time);
+		/* What is held now stays held until the next event */
+		for (i = 0; i < sim->num_resource_types; i++) {
+			sim->busy[i] += (double) (sim->events[0].time - simulation_time) *
+				(sim->num_each_resource_type[i] - sim->banker.available[i]);
+		}
+		simulation_time = sim->events[0].time;
 	}
+	sim->end_time = simulation_time;
+	if (sim->trace != NULL) {
+		static const int ends[] = {
+			TRACE_COMPLETED, TRACE_DEADLOCK, TRACE_STUCK
+		};
+		trace_event(sim->trace, ends[sim->outcome], simulation_time, -1);
+	}
+	free(sim->events);
+	free(sim->arrivals);
+	free(sim->askers);
+	free(sim->candidates);
+	free(sim->by_type);
+	free(sim->type_head);
+	banker_free(&sim->banker);
 }
 
-int resources_available(process_t *process) {
+/* Sum up a run once run_simulation has returned */
+void summarize(simulation_t *sim, summary_t *summary) {
+	int counted = 0;
 	int i;
-	for (i = 0; i < num_resource_types; i++) {
-		if (process->needed_resources[i] > avail_each_resource_type[i])
-			return 0;
+
+	memset(summary, 0, sizeof(*summary));
+	summary->outcome = sim->outcome;
+	summary->makespan = sim->end_time;
+	for (i = 0; i < sim->num_processes; i++) {
+		process_t *process = &sim->processes[i];
+		if (!process->completed)
+			continue;
+		summary->average_wait += process->finish_time -
+			process->arrival_time - process->simulation_time;
+		counted++;
 	}
-	return 1;
+	if (counted > 0)
+		summary->average_wait /= counted;
+	counted = 0;
+	for (i = 0; i < sim->num_resource_types; i++) {
+		if (sim->num_each_resource_type[i] == 0 || sim->end_time == 0)
+			continue;
+		summary->utilization += sim->busy[i] /
+			((double) sim->num_each_resource_type[i] * sim->end_time);
+		counted++;
+	}
+	if (counted > 0)
+		summary->utilization /= counted;
 }
 
-void allocate_resources(process_t *process) {
+/* Free what use_scenario and run_simulation allocated. The scenario
+   itself is left alone. */
+void free_simulation(simulation_t *sim) {
+	free(sim->processes);
+	free(sim->steps);
+	free(sim->busy);
+	sim->processes = NULL;
+	sim->steps = NULL;
+	sim->busy = NULL;
+}
+
+/* Trace the state of each arrived process at the end of a time step in
+   which something happened */
+void trace_step(simulation_t *sim, long simulation_time) {
+	int kind;
 	int i;
-	for (i = 0; i < num_resource_types; i++) {
-		avail_each_resource_type[i] -= process->needed_resources[i];
+
+	for (i = sim->first_active; i != -1; i = sim->processes[i].next) {
+		process_t *process = &sim->processes[i];
+		/* Notify when process has arrived */
+		if (process->arrival_time == simulation_time)
+			trace_event(sim->trace, TRACE_ARRIVED, simulation_time, i);
+		if (process->asked == 0)
+			kind = TRACE_RUNNING;
+		else if (process->asked == ASK_MORE)
+			kind = process->granted ? TRACE_GRANTED : TRACE_WAITING;
+		else
+			/* resources may have been unavailable */
+			kind = process->granted ? TRACE_STARTED : TRACE_IDLE;
+		trace_event(sim->trace, kind, simulation_time, i);
 	}
+	if (system_idle(sim))
+		trace_event(sim->trace, TRACE_SYSTEM_IDLE, simulation_time, -1);
 }
 
-void release_resources(process_t *process) {
+/* Queue the next request or the completion of a process that has just
+   started or resumed running. */
+void schedule_next(simulation_t *sim, int i) {
+	process_t *process = &sim->processes[i];
+	long until;
+
+	if (process->next_step < process->num_steps) {
+		until = process->steps[process->next_step].offset;
+		push_event(sim, process->resumed_at + until - process->run_time, i,
+				   EVENT_REQUEST);
+	} else {
+		until = process->simulation_time;
+		push_event(sim, process->resumed_at + until - process->run_time, i,
+				   EVENT_COMPLETION);
+	}
+}
+
+/* Trace the time steps from first up to but not including last, in
+   which no process arrives, starts or finishes, as one quiet span */
+void trace_quiet_ticks(simulation_t *sim, long first, long last) {
 	int i;
-	for (i = 0; i < num_resource_types; i++) {
-		avail_each_resource_type[i] += process->needed_resources[i];
+
+	if (first >= last)
+		return;
+	trace_quiet(sim->trace, first, last);
+	/* Same states, in the same order, as trace_step gives */
+	for (i = sim->first_active; i != -1; i = sim->processes[i].next) {
+		process_t *process = &sim->processes[i];
+		if (process->start_time != -1 && process->completed == 0) {
+			trace_event(sim->trace, process->waiting ? TRACE_WAITING :
+						TRACE_RUNNING, first, i);
+		} else if (process->start_time == -1 &&
+				   process->arrival_time < first) {
+			trace_event(sim->trace, TRACE_IDLE, first, i);
+		}
 	}
+	if (system_idle(sim))
+		trace_event(sim->trace, TRACE_SYSTEM_IDLE, first, -1);
+	trace_quiet_end(sim->trace);
 }
 
-int all_processes_completed() {
-	int done = 1;
-	int i = 0;
-	for (i = 0; i < num_processes; i++) {
-		if (processes[i].completed != 1)
-			done = 0;
+void push_event(simulation_t *sim, long time, int process, int type) {
+	int i = sim->num_events++;
+	sim->events[i].time = time;
+	sim->events[i].process = process;
+	sim->events[i].type = type;
+	/* Sift up */
+	while (i > 0 &&
+		   event_before(&sim->events[i], &sim->events[(i - 1) / 2])) {
+		event_t tmp = sim->events[i];
+		sim->events[i] = sim->events[(i - 1) / 2];
+		sim->events[(i - 1) / 2] = tmp;
+		i = (i - 1) / 2;
 	}
-	return done;
 }
 
-int is_deadlock(int simulation_time) {
+event_t pop_event(simulation_t *sim) {
+	event_t top = sim->events[0];
 	int i = 0;
-	for (i = 0; i < num_processes; i++) {
-		/* ignore completed processes */
-		if (processes[i].completed) continue;
-		/* no deadlock if any process is running */
-		if (processes[i].start_time != -1 && !processes[i].completed) return 0;
-		/* no deadlock if there are sufficient resources for a process */
-		if (resources_available(&processes[i])) return 0;
+	sim->events[0] = sim->events[--sim->num_events];
+	/* Sift down */
+	while (1) {
+		int child = 2 * i + 1;
+		if (child >= sim->num_events)
+			break;
+		if (child + 1 < sim->num_events &&
+			event_before(&sim->events[child + 1], &sim->events[child]))
+			child++;
+		if (!event_before(&sim->events[child], &sim->events[i]))
+			break;
+		event_t tmp = sim->events[i];
+		sim->events[i] = sim->events[child];
+		sim->events[child] = tmp;
+		i = child;
 	}
-	return 1;
+	return top;
 }
 
-int system_idle() {
-	int i = 0;
-	for (i = 0; i < num_processes; i++) {
-		if (processes[i].completed) continue;
-		if (processes[i].start_time != -1) return 0;
+/* Events at the same time are handled in process order, like the
+   original scan over all processes */
+int event_before(event_t *a, event_t *b) {
+	if (a->time != b->time)
+		return a->time < b->time;
+	return a->process < b->process;
+}
+
+/* Whether the first request of a process could be met right now */
+int resources_available(simulation_t *sim, process_t *process) {
+	return vec_le(process->steps[0].request, sim->banker.available,
+				  sim->num_resource_types);
+}
+
+int all_processes_completed(simulation_t *sim) {
+	return sim->num_completed == sim->num_processes;
+}
+
+/* Nothing is running and no process that hasn't started could start
+   with what is available. The head of each type's row in by_type is
+   the smallest first request for that type among those that haven't
+   started; if any type's is too big nothing can start, and otherwise
+   only the processes that fit the tightest type are checked. */
+int is_deadlock(simulation_t *sim) {
+	int n = sim->num_processes;
+	int best = -1;
+	int best_count = n + 1;
+	int *row;
+	int count;
+	int j, k;
+
+	if (sim->num_running + sim->num_waiting > 0)
+		return 0;
+	if (sim->by_type == NULL) {
+		/* Out of memory for the index, so look at everyone */
+		for (k = 0; k < n; k++) {
+			process_t *process = &sim->processes[k];
+			if (process->start_time == -1 && resources_available(sim, process))
+				return 0;
+		}
+		return 1;
+	}
+	for (j = 0; j < sim->num_resource_types; j++) {
+		count = fitting(sim, j);
+		if (count == 0)
+			return 1;
+		if (count < best_count) {
+			best = j;
+			best_count = count;
+		}
+	}
+	/* No resource types: anything left could start */
+	if (best == -1)
+		return sim->num_completed == n;
+	row = &sim->by_type[(size_t) best * n + sim->type_head[best]];
+	for (k = 0; k < best_count; k++) {
+		process_t *process = &sim->processes[row[k]];
+		if (process->start_time == -1 && resources_available(sim, process))
+			return 0;
 	}
 	return 1;
 }
+
+/* Move a type's head past the processes that have started, and count
+   those from there whose first request for the type is available */
+int fitting(simulation_t *sim, int type) {
+	int n = sim->num_processes;
+	int *row = &sim->by_type[(size_t) type * n];
+	int available = sim->banker.available[type];
+	int lo, hi;
+
+	while (sim->type_head[type] < n &&
+		   sim->processes[row[sim->type_head[type]]].start_time != -1)
+		sim->type_head[type]++;
+	lo = sim->type_head[type];
+	hi = n;
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (sim->processes[row[mid]].steps[0].request[type] <= available)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - sim->type_head[type];
+}
+
+int system_idle(simulation_t *sim) {
+	return sim->num_running + sim->num_waiting == 0;
+}
+
+/* Link the processes arriving in this time step into the active list,
+   keeping it in index order */
+void active_merge(simulation_t *sim) {
+	int prev = -1;
+	int next = sim->first_active;
+	int a = 0;
+	int i;
+
+	while (a < sim->num_arrivals) {
+		if (next == -1 || sim->arrivals[a] < next) {
+			i = sim->arrivals[a++];
+			sim->processes[i].prev = prev;
+			sim->processes[i].next = next;
+			if (prev == -1)
+				sim->first_active = i;
+			else
+				sim->processes[prev].next = i;
+			if (next != -1)
+				sim->processes[next].prev = i;
+		} else {
+			i = next;
+			next = sim->processes[i].next;
+		}
+		prev = i;
+	}
+}
+
+/* Unlink a completed process from the active list */
+void active_remove(simulation_t *sim, int i) {
+	process_t *process = &sim->processes[i];
+	if (process->prev == -1)
+		sim->first_active = process->next;
+	else
+		sim->processes[process->prev].next = process->next;
+	if (process->next != -1)
+		sim->processes[process->next].prev = process->prev;
+}
+
+/* Link the processes that started asking in this time step into the
+   asking list, keeping it in index order, and make the whole list this
+   time step's candidates */
+void asking_merge(simulation_t *sim) {
+	int prev = -1;
+	int next = sim->first_asking;
+	int a = 0;
+	int i;
+
+	sim->num_candidates = 0;
+	while (next != -1 || a < sim->num_askers) {
+		process_t *process;
+		if (a < sim->num_askers && (next == -1 || sim->askers[a] < next)) {
+			i = sim->askers[a++];
+			process = &sim->processes[i];
+			process->ask_prev = prev;
+			process->ask_next = next;
+			if (prev == -1)
+				sim->first_asking = i;
+			else
+				sim->processes[prev].ask_next = i;
+			if (next != -1)
+				sim->processes[next].ask_prev = i;
+			process->asked = process->start_time == -1 ? ASK_START : ASK_MORE;
+		} else {
+			i = next;
+			process = &sim->processes[i];
+		}
+		prev = i;
+		next = process->ask_next;
+		sim->candidates[sim->num_candidates++].process = i;
+	}
+}
+
+/* Unlink a process that was granted what it asked for */
+void asking_remove(simulation_t *sim, int i) {
+	process_t *process = &sim->processes[i];
+	if (process->ask_prev == -1)
+		sim->first_asking = process->ask_next;
+	else
+		sim->processes[process->ask_prev].ask_next = process->ask_next;
+	if (process->ask_next != -1)
+		sim->processes[process->ask_next].ask_prev = process->ask_prev;
+}
+
+/* Fill by_type: for each resource type, the processes by their first
+   request for it, then index. Left NULL if out of memory. */
+void sort_by_type(simulation_t *sim) {
+	int n = sim->num_processes;
+	long *keys = malloc(n * 2 * sizeof(long));
+	int i, j;
+
+	sim->by_type = malloc((size_t) sim->num_resource_types * n * sizeof(int));
+	sim->type_head = calloc(sim->num_resource_types, sizeof(int));
+	if (keys == NULL || sim->by_type == NULL || sim->type_head == NULL) {
+		free(keys);
+		free(sim->by_type);
+		free(sim->type_head);
+		sim->by_type = NULL;
+		sim->type_head = NULL;
+		return;
+	}
+	for (j = 0; j < sim->num_resource_types; j++) {
+		int *row = &sim->by_type[(size_t) j * n];
+		for (i = 0; i < n; i++) {
+			keys[2 * i] = sim->processes[i].steps[0].request[j];
+			keys[2 * i + 1] = i;
+		}
+		qsort(keys, n, 2 * sizeof(long), demand_compare);
+		for (i = 0; i < n; i++) {
+			row[i] = keys[2 * i + 1];
+		}
+	}
+	free(keys);
+}
+
+/* Order for sort_by_type's (request, index) pairs */
+int demand_compare(const void *a, const void *b) {
+	const long *x = a;
+	const long *y = b;
+	if (x[0] != y[0])
+		return x[0] < y[0] ? -1 : 1;
+	return x[1] < y[1] ? -1 : x[1] > y[1];
+}
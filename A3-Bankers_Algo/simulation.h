@@ -0,0 +1,129 @@
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include <stdio.h>
+#include "banker.h"
+#include "policy.h"
+#include "scenario.h"
+#include "trace.h"
+
+/* A request for more resources, made after a process has run for a
+   given time */
+typedef struct step_t {
+	long offset;
+	int *request;
+} step_t;
+
+typedef struct process_t {
+	char *name;
+	int *needed_resources;	/* maximum claim */
+	long arrival_time;
+	long simulation_time;
+	long start_time;
+	int completed;
+	step_t *steps;		/* by offset; steps[0] is made on starting */
+	int num_steps;
+	int next_step;		/* next request, or the one being waited on */
+	int waiting;		/* blocked on steps[next_step] */
+	long run_time;		/* time run before resumed_at */
+	long resumed_at;	/* when it last started running */
+	int next;		/* neighbours in the active list, -1 at the ends */
+	int prev;
+	int ask_next;		/* and in the asking list */
+	int ask_prev;
+	long finish_time;
+	int asked;		/* this time step, ASK_START or ASK_MORE, or 0 */
+	int granted;		/* and whether it was given them */
+} process_t;
+
+#define ASK_START 1
+#define ASK_MORE 2
+
+#define EVENT_ARRIVAL 0
+#define EVENT_COMPLETION 1
+#define EVENT_REQUEST 2
+
+/* Something that happens to a process at a given time */
+typedef struct event_t {
+	long time;
+	int process;	/* index into processes */
+	int type;
+} event_t;
+
+/* How a simulation ended */
+#define SIM_COMPLETED 0
+#define SIM_DEADLOCK 1	/* nothing running and nothing could start */
+#define SIM_STUCK 2	/* only waiting processes left */
+
+extern const char *outcome_names[];
+
+/* Everything one run of the simulation works on, so several can run
+   at once */
+typedef struct simulation_t {
+	int num_resource_types;
+	int *num_each_resource_type;
+	banker_t banker;
+	int num_processes;
+	process_t *processes;
+	/* Claims of all processes, one row each, in a single block */
+	int *claims;
+	step_t *steps;		/* all steps, when set up from a scenario */
+
+	/* Pending events, a min-heap on (time, process) */
+	event_t *events;
+	int num_events;
+
+	const policy_t *policy;	/* NULL for input order */
+	/* Processes asking for resources in the current time step */
+	ranked_t *candidates;
+	int num_candidates;
+
+	trace_t *trace;		/* where to report, or NULL for nowhere */
+	/* Only print the times at which something happens */
+	int compact_output;
+
+	/* Processes that have arrived but not completed, in index order.
+	   These are the only ones printed each time step, so the list is
+	   only kept up when there is a trace. */
+	int first_active;
+	/* Processes arriving in the current time step, in index order, to
+	   be merged into the active list */
+	int *arrivals;
+	int num_arrivals;
+	/* Processes that have arrived but not started, or are blocked on a
+	   request, in index order. Only these are offered resources. */
+	int first_asking;
+	/* Those that started asking in the current time step, in index
+	   order, to be merged into the asking list */
+	int *askers;
+	int num_askers;
+	/* How many processes are in each state */
+	int num_running;
+	int num_waiting;	/* started, but blocked on a request */
+	int num_completed;
+	/* A row per resource type of the processes by their first request
+	   for it, smallest first. Those before type_head in a row have all
+	   started. */
+	int *by_type;
+	int *type_head;
+
+	/* Results */
+	int outcome;
+	long end_time;
+	double *busy;		/* instance-time held, per resource type */
+} simulation_t;
+
+/* What a finished run comes to */
+typedef struct summary_t {
+	int outcome;
+	long makespan;
+	double average_wait;	/* time not running, over completed processes */
+	double utilization;	/* mean over resource types with instances */
+} summary_t;
+
+void use_scenario(simulation_t *sim, scenario_t *scenario);
+void run_simulation(simulation_t *sim);
+void summarize(simulation_t *sim, summary_t *summary);
+void free_simulation(simulation_t *sim);
+
+#endif
@@ -0,0 +1,335 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cbanker.h"
+
+/* Stress test of the concurrent banker (cbanker.c), and a demo of it.
+ * Each thread drives one process, which asks for its claim in a few
+ * requests, holds it for a moment and releases it, over and over. For
+ * 1, 2, 4, ... threads up to -t it prints the requests granted per
+ * second, the share granted without the lock, how often a thread had to
+ * sleep, and the latency of cbanker_acquire.
+ *
+ * -t threads	most threads (one per core)
+ * -r a:b:c	instances of each resource type (64:64:64)
+ * -c fraction	largest claim on each type, as a fraction of its
+ *		instances; each process's is drawn up to it (0.1)
+ * -k requests	requests each claim is split over (2)
+ * -s seconds	how long to run each thread count (1)
+ * -h loops	busy work while holding the whole claim (100)
+ * -l		take the lock for every request, for comparison
+ * -v		check the state is safe every millisecond
+ */
+
+#define MAX_TYPES 64
+
+/* Latencies in buckets of an eighth of a power of two of nanoseconds */
+#define SUB_BUCKETS 8
+#define NUM_BUCKETS (64 * SUB_BUCKETS)
+
+typedef struct config_t {
+	int threads;
+	int num_types;
+	int total[MAX_TYPES];
+	double claim;
+	int requests;
+	double seconds;
+	long hold;
+	int locked;
+	int verify;
+} config_t;
+
+typedef struct stress_worker_t {
+	cbanker_t *cb;
+	const config_t *config;
+	int process;
+	int *claim;
+	volatile int *stop;
+	long grants;
+	long latency[NUM_BUCKETS];
+	long worst;
+	pthread_t thread;
+} stress_worker_t;
+
+static int parse_total(config_t *config, const char *text);
+static int run(const config_t *config, int threads, uint64_t *rng);
+static void *stress_worker(void *arg);
+static void record(stress_worker_t *worker, long ns);
+static double percentile(const long *latency, long count, double fraction);
+static double bucket_top(int bucket);
+static long elapsed_ns(const struct timespec *start,
+					   const struct timespec *end);
+static uint64_t next_random(uint64_t *rng);
+
+int main(int argc, char *argv[]) {
+	config_t config;
+	uint64_t rng = 1;
+	int threads;
+	int ch;
+
+	memset(&config, 0, sizeof(config));
+	config.threads = sysconf(_SC_NPROCESSORS_ONLN);
+	parse_total(&config, "64:64:64");
+	config.claim = 0.1;
+	config.requests = 2;
+	config.seconds = 1;
+	config.hold = 100;
+	while ((ch = getopt(argc, argv, "c:h:k:lr:s:t:v")) != -1) {
+		if (ch == 'c') {
+			config.claim = atof(optarg);
+		} else if (ch == 'h') {
+			config.hold = atol(optarg);
+		} else if (ch == 'k') {
+			config.requests = atoi(optarg);
+		} else if (ch == 'l') {
+			config.locked = 1;
+		} else if (ch == 'r') {
+			if (parse_total(&config, optarg) != 0) {
+				fprintf(stderr, "Bad resources %s\n", optarg);
+				exit(1);
+			}
+		} else if (ch == 's') {
+			config.seconds = atof(optarg);
+		} else if (ch == 't') {
+			config.threads = atoi(optarg);
+		} else if (ch == 'v') {
+			config.verify = 1;
+		} else {
+			fprintf(stderr, "usage: %s [-t threads] [-r a:b:c] "
+					"[-c fraction] [-k requests] [-s seconds] [-h loops] "
+					"[-l] [-v]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (config.threads <= 0)
+		config.threads = 1;
+	if (config.requests <= 0)
+		config.requests = 1;
+	if (config.claim < 0 || config.claim > 1) {
+		fprintf(stderr, "The claim must be a fraction from 0 to 1\n");
+		exit(1);
+	}
+
+	fprintf(stdout, "%7s %12s %9s %9s %9s %9s %9s\n", "threads",
+			"grants/s", "lock-free", "sleeps/s", "p50 us", "p99 us",
+			"max us");
+	for (threads = 1; ; threads *= 2) {
+		if (threads > config.threads)
+			threads = config.threads;
+		if (run(&config, threads, &rng) != 0)
+			return 1;
+		if (threads == config.threads)
+			break;
+	}
+	return 0;
+}
+
+static int parse_total(config_t *config, const char *text) {
+	char *end;
+
+	config->num_types = 0;
+	while (1) {
+		long total = strtol(text, &end, 10);
+		if (end == text || total < 0 || config->num_types == MAX_TYPES)
+			return -1;
+		config->total[config->num_types++] = total;
+		if (*end == '\0')
+			return 0;
+		if (*end != ':')
+			return -1;
+		text = end + 1;
+	}
+}
+
+/* Run threads workers for the configured time and print a line */
+static int run(const config_t *config, int threads, uint64_t *rng) {
+	stress_worker_t *workers;
+	long latency[NUM_BUCKETS];
+	cbanker_t cb;
+	int *claims;
+	struct timespec start, end, nap;
+	volatile int stop = 0;
+	long grants = 0;
+	long worst = 0;
+	long fast, slow, waits;
+	long unsafe = 0;
+	double seconds;
+	int i, j, b;
+
+	if (cbanker_init(&cb, config->num_types, config->total, threads) != 0) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	cb.lock_free = !config->locked;
+	workers = calloc(threads, sizeof(stress_worker_t));
+	claims = malloc((size_t) threads * config->num_types * sizeof(int));
+	if (workers == NULL || claims == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		free(workers);
+		free(claims);
+		cbanker_free(&cb);
+		return -1;
+	}
+	for (i = 0; i < threads; i++) {
+		int *claim = &claims[i * config->num_types];
+		for (j = 0; j < config->num_types; j++) {
+			int most = config->claim * config->total[j];
+			claim[j] = next_random(rng) % (most + 1);
+		}
+		cbanker_set_max(&cb, i, claim);
+		workers[i].cb = &cb;
+		workers[i].config = config;
+		workers[i].process = i;
+		workers[i].claim = claim;
+		workers[i].stop = &stop;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < threads; i++) {
+		pthread_create(&workers[i].thread, NULL, stress_worker, &workers[i]);
+	}
+	nap.tv_sec = 0;
+	nap.tv_nsec = config->verify ? 1000000 : 10000000;
+	do {
+		nanosleep(&nap, NULL);
+		if (config->verify && !cbanker_is_safe(&cb))
+			unsafe++;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+	} while (elapsed_ns(&start, &end) < config->seconds * 1e9);
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	seconds = elapsed_ns(&start, &end) / 1e9;
+
+	memset(latency, 0, sizeof(latency));
+	for (i = 0; i < threads; i++) {
+		grants += workers[i].grants;
+		if (workers[i].worst > worst)
+			worst = workers[i].worst;
+		for (b = 0; b < NUM_BUCKETS; b++) {
+			latency[b] += workers[i].latency[b];
+		}
+	}
+	cbanker_counts(&cb, &fast, &slow, &waits);
+	fprintf(stdout, "%7d %12.0f %8.1f%% %9.0f %9.2f %9.2f %9.2f\n",
+			threads, grants / seconds,
+			grants > 0 ? 100.0 * fast / grants : 0.0, waits / seconds,
+			percentile(latency, grants, 0.5) / 1000,
+			percentile(latency, grants, 0.99) / 1000, worst / 1000.0);
+
+	/* Everything has been released, so it should all be back */
+	for (j = 0; j < config->num_types; j++) {
+		if (cb.available[j] != config->total[j]) {
+			fprintf(stderr, "Resource %d: %d of %d available at the end\n",
+					j, cb.available[j], config->total[j]);
+			unsafe++;
+		}
+	}
+	if (fast + slow != grants) {
+		fprintf(stderr, "%ld grants counted by the banker, %ld by the "
+				"threads\n", fast + slow, grants);
+		unsafe++;
+	}
+	if (unsafe > 0)
+		fprintf(stderr, "%ld unsafe states or inconsistencies\n", unsafe);
+	free(workers);
+	free(claims);
+	cbanker_free(&cb);
+	return unsafe > 0 ? -1 : 0;
+}
+
+/* Ask for the claim in config->requests parts, hold it, release it,
+   until told to stop */
+static void *stress_worker(void *arg) {
+	stress_worker_t *worker = arg;
+	const config_t *config = worker->config;
+	int m = config->num_types;
+	int k = config->requests;
+	int request[MAX_TYPES];
+	struct timespec before, after;
+	volatile long spin;
+	int part, j;
+
+	while (!__atomic_load_n(worker->stop, __ATOMIC_ACQUIRE)) {
+		for (part = 0; part < k; part++) {
+			for (j = 0; j < m; j++) {
+				long claim = worker->claim[j];
+				request[j] = claim * (part + 1) / k - claim * part / k;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &before);
+			if (cbanker_acquire(worker->cb, worker->process, request) !=
+				BANKER_GRANTED) {
+				fprintf(stderr, "Process %d: invalid request\n",
+						worker->process);
+				return NULL;
+			}
+			clock_gettime(CLOCK_MONOTONIC, &after);
+			record(worker, elapsed_ns(&before, &after));
+			worker->grants++;
+		}
+		for (spin = 0; spin < config->hold; spin++)
+			;
+		cbanker_release(worker->cb, worker->process);
+	}
+	return NULL;
+}
+
+/* Count a latency in its bucket: the power of two below it, then which
+   eighth of the way to the next */
+static void record(stress_worker_t *worker, long ns) {
+	int bucket;
+	int bits;
+
+	if (ns > worker->worst)
+		worker->worst = ns;
+	if (ns < SUB_BUCKETS) {
+		bucket = ns;
+	} else {
+		bits = 63 - __builtin_clzl(ns);
+		bucket = bits * SUB_BUCKETS +
+			((ns >> (bits - 3)) & (SUB_BUCKETS - 1));
+	}
+	worker->latency[bucket]++;
+}
+
+/* The top of the bucket that fraction of the latencies fall within */
+static double percentile(const long *latency, long count, double fraction) {
+	long seen = 0;
+	int b;
+
+	for (b = 0; b < NUM_BUCKETS; b++) {
+		seen += latency[b];
+		if (seen > 0 && seen >= fraction * count)
+			return bucket_top(b);
+	}
+	return 0;
+}
+
+static double bucket_top(int bucket) {
+	int bits = bucket / SUB_BUCKETS;
+	int eighth = bucket % SUB_BUCKETS;
+
+	if (bucket < SUB_BUCKETS)
+		return bucket + 1;
+	return (double) (1L << bits) * (SUB_BUCKETS + eighth + 1) / SUB_BUCKETS;
+}
+
+static long elapsed_ns(const struct timespec *start,
+					   const struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) * 1000000000L +
+		(end->tv_nsec - start->tv_nsec);
+}
+
+/* xorshift64*, as in sweep.c */
+static uint64_t next_random(uint64_t *rng) {
+	*rng ^= *rng >> 12;
+	*rng ^= *rng << 25;
+	*rng ^= *rng >> 27;
+	return *rng * 0x2545F4914F6CDD1DULL;
+}
@@ -0,0 +1,480 @@
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "simulation.h"
+#include "sweep.h"
+
+/* A sweep runs the simulation on many random scenarios and sums up how
+ * they went. The spec sets how the scenarios are drawn, for example
+ *
+ *	runs=5000,processes=40,resources=10:6:4,arrival=exp:3,
+ *	duration=uniform:5:50,demand=uniform:0:0.6,requests=2,seed=7
+ *
+ * runs		number of scenarios (1000)
+ * seed		seed of the first; run i uses seed + i (1)
+ * processes	processes in each scenario (20)
+ * resources	instances of each resource type, colon-separated (10:10:10)
+ * arrival	time between arrivals (exp:2)
+ * duration	length of each process, at least 1 (uniform:1:20)
+ * demand	claim on each type, as a fraction of its instances
+ *		(uniform:0:1)
+ * requests	requests each claim is split over, evenly spread over
+ *		the process's length (1)
+ * policy	order in which waiting processes are offered resources,
+ *		see policy.c (input)
+ *
+ * A distribution is const:v, uniform:lo:hi, exp:mean or
+ * normal:mean:sd. Each run only depends on its seed, so the results
+ * don't depend on the number of threads.
+ *
+ * Runs are handed out by work stealing: each thread starts with an
+ * equal share and takes from the front of it, and a thread that runs
+ * out takes the back half of another's remaining share.
+ */
+
+#define DIST_CONST 0
+#define DIST_UNIFORM 1
+#define DIST_EXP 2
+#define DIST_NORMAL 3
+
+#define MAX_TYPES 64
+
+typedef struct dist_t {
+	int kind;
+	double a;
+	double b;
+} dist_t;
+
+typedef struct spec_t {
+	int runs;
+	unsigned long seed;
+	int processes;
+	int num_types;
+	int total[MAX_TYPES];
+	dist_t arrival;
+	dist_t duration;
+	dist_t demand;
+	int requests;
+	const policy_t *policy;
+} spec_t;
+
+struct sweep_t;
+
+/* One thread and the runs it still owns, next up to end */
+typedef struct worker_t {
+	pthread_mutex_t lock;
+	int next;
+	int end;
+	int steals;
+	int index;
+	int started;
+	pthread_t thread;
+	struct sweep_t *sweep;
+} worker_t;
+
+typedef struct sweep_t {
+	spec_t spec;
+	summary_t *results;
+	worker_t *workers;
+	int num_workers;
+} sweep_t;
+
+static int parse_spec(spec_t *spec, const char *text);
+static int parse_dist(dist_t *dist, const char *text);
+static void *sweep_worker(void *arg);
+static int take_run(worker_t *worker);
+static void run_one(const spec_t *spec, int run, summary_t *result);
+static int generate(const spec_t *spec, uint64_t *rng, scenario_t *scenario);
+static double sample(const dist_t *dist, uint64_t *rng);
+static double uniform(uint64_t *rng);
+static uint64_t next_random(uint64_t *rng);
+static void print_summary(sweep_t *sweep, double seconds);
+static int compare_long(const void *a, const void *b);
+
+int run_sweep(const char *spec_text, int threads) {
+	sweep_t sweep;
+	struct timespec start, end;
+	int share, i;
+
+	memset(&sweep, 0, sizeof(sweep));
+	if (parse_spec(&sweep.spec, spec_text) != 0)
+		return -1;
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+	if (threads > sweep.spec.runs)
+		threads = sweep.spec.runs;
+
+	sweep.results = calloc(sweep.spec.runs, sizeof(summary_t));
+	sweep.workers = calloc(threads, sizeof(worker_t));
+	if (sweep.results == NULL || sweep.workers == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		free(sweep.results);
+		free(sweep.workers);
+		return -1;
+	}
+	sweep.num_workers = threads;
+	share = sweep.spec.runs / threads;
+	for (i = 0; i < threads; i++) {
+		worker_t *worker = &sweep.workers[i];
+		pthread_mutex_init(&worker->lock, NULL);
+		worker->next = i * share;
+		worker->end = i == threads - 1 ? sweep.spec.runs : (i + 1) * share;
+		worker->index = i;
+		worker->sweep = &sweep;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < threads; i++) {
+		/* if this fails, the others steal its share */
+		sweep.workers[i].started =
+			pthread_create(&sweep.workers[i].thread, NULL, sweep_worker,
+						   &sweep.workers[i]) == 0;
+	}
+	for (i = 0; i < threads; i++) {
+		if (sweep.workers[i].started)
+			pthread_join(sweep.workers[i].thread, NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	print_summary(&sweep, (end.tv_sec - start.tv_sec) +
+				  (end.tv_nsec - start.tv_nsec) / 1e9);
+	for (i = 0; i < threads; i++) {
+		pthread_mutex_destroy(&sweep.workers[i].lock);
+	}
+	free(sweep.results);
+	free(sweep.workers);
+	return 0;
+}
+
+static void *sweep_worker(void *arg) {
+	worker_t *worker = arg;
+	int run;
+
+	while ((run = take_run(worker)) != -1) {
+		run_one(&worker->sweep->spec, run, &worker->sweep->results[run]);
+	}
+	return NULL;
+}
+
+/* The next run for a worker: from its own share if it has any left,
+   otherwise the back half of the first other share it finds. Returns
+   -1 once there is nothing left anywhere. Shares only shrink, so one
+   pass over the others that finds nothing means all work is taken. */
+static int take_run(worker_t *worker) {
+	sweep_t *sweep = worker->sweep;
+	int run = -1;
+	int i;
+
+	pthread_mutex_lock(&worker->lock);
+	if (worker->next < worker->end)
+		run = worker->next++;
+	pthread_mutex_unlock(&worker->lock);
+	if (run != -1)
+		return run;
+
+	for (i = 1; i < sweep->num_workers; i++) {
+		worker_t *victim =
+			&sweep->workers[(worker->index + i) % sweep->num_workers];
+		int first, last;
+
+		pthread_mutex_lock(&victim->lock);
+		last = victim->end;
+		first = last - (victim->end - victim->next + 1) / 2;
+		if (first < last)
+			victim->end = first;
+		pthread_mutex_unlock(&victim->lock);
+		if (first >= last)
+			continue;
+
+		pthread_mutex_lock(&worker->lock);
+		worker->next = first + 1;
+		worker->end = last;
+		worker->steals++;
+		pthread_mutex_unlock(&worker->lock);
+		return first;
+	}
+	return -1;
+}
+
+/* Draw scenario number run and simulate it without output */
+static void run_one(const spec_t *spec, int run, summary_t *result) {
+	simulation_t sim;
+	scenario_t scenario;
+	uint64_t rng = spec->seed + run;
+
+	memset(result, 0, sizeof(*result));
+	result->outcome = -1;
+	if (generate(spec, &rng, &scenario) != 0)
+		return;
+	memset(&sim, 0, sizeof(sim));
+	sim.trace = NULL;
+	sim.policy = spec->policy;
+	use_scenario(&sim, &scenario);
+	run_simulation(&sim);
+	summarize(&sim, result);
+	free_simulation(&sim);
+	scenario_free(&scenario);
+}
+
+/* Fill in a random scenario following the spec */
+static int generate(const spec_t *spec, uint64_t *rng, scenario_t *scenario) {
+	int m = spec->num_types;
+	int n = spec->processes;
+	int steps_each = spec->requests;
+	long time = 0;
+	int i, j, k;
+
+	/* Mix the seed, so neighbouring seeds give unrelated streams */
+	*rng = (*rng + 0x9E3779B97F4A7C15ULL) * 0xBF58476D1CE4E5B9ULL;
+	*rng ^= *rng >> 31;
+	if (*rng == 0)
+		*rng = 1;
+
+	memset(scenario, 0, sizeof(*scenario));
+	if (scenario_alloc(scenario, m, n, (size_t) n * steps_each,
+					   (size_t) n * 12) != 0)
+		return -1;
+	memcpy(scenario->total, spec->total, m * sizeof(int32_t));
+
+	for (i = 0; i < n; i++) {
+		int32_t *claim = &scenario->claims[(size_t) i * m];
+		uint32_t first = scenario->num_steps;
+		long length;
+		int count;
+
+		time += (long) (sample(&spec->arrival, rng) + 0.5);
+		length = (long) (sample(&spec->duration, rng) + 0.5);
+		if (length < 1)
+			length = 1;
+		scenario->arrival[i] = time;
+		scenario->length[i] = length;
+		scenario->name_at[i] = i * 12;
+		snprintf(scenario->names + i * 12, 12, "P%d", i + 1);
+		for (j = 0; j < m; j++) {
+			long want = (long) (sample(&spec->demand, rng) *
+								spec->total[j] + 0.5);
+			claim[j] = want < 0 ? 0 :
+				want > spec->total[j] ? spec->total[j] : want;
+		}
+
+		/* Split the claim over count requests, at even offsets */
+		count = steps_each < length ? steps_each : length;
+		scenario->first_step[i] = first;
+		for (k = 0; k < count; k++) {
+			scenario->step_offset[first + k] = length * k / count;
+		}
+		for (j = 0; j < m; j++) {
+			int left = claim[j];
+			for (k = 0; k < count - 1; k++) {
+				int part = (int) (uniform(rng) * (left + 1));
+				scenario->step_request[(size_t) (first + k) * m + j] = part;
+				left -= part;
+			}
+			scenario->step_request[(size_t) (first + count - 1) * m + j] =
+				left;
+		}
+		scenario->num_steps += count;
+	}
+	scenario->first_step[n] = scenario->num_steps;
+	return 0;
+}
+
+static double sample(const dist_t *dist, uint64_t *rng) {
+	double u, v, x;
+
+	switch (dist->kind) {
+	case DIST_UNIFORM:
+		return dist->a + (dist->b - dist->a) * uniform(rng);
+	case DIST_EXP:
+		return -dist->a * log(1 - uniform(rng));
+	case DIST_NORMAL:
+		/* Box-Muller, clamped at 0 */
+		u = 1 - uniform(rng);
+		v = uniform(rng);
+		x = dist->a + dist->b * sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+		return x < 0 ? 0 : x;
+	default:
+		return dist->a;
+	}
+}
+
+/* In [0, 1) */
+static double uniform(uint64_t *rng) {
+	return (next_random(rng) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* xorshift64* */
+static uint64_t next_random(uint64_t *rng) {
+	*rng ^= *rng >> 12;
+	*rng ^= *rng << 25;
+	*rng ^= *rng >> 27;
+	return *rng * 0x2545F4914F6CDD1DULL;
+}
+
+static void print_summary(sweep_t *sweep, double seconds) {
+	spec_t *spec = &sweep->spec;
+	long *makespans = malloc(spec->runs * sizeof(long));
+	int outcomes[3] = { 0, 0, 0 };
+	int failed = 0, completed = 0, steals = 0;
+	double utilization = 0, min_util = 1, max_util = 0;
+	double makespan_sum = 0, wait = 0;
+	int i;
+
+	for (i = 0; i < spec->runs; i++) {
+		summary_t *result = &sweep->results[i];
+		if (result->outcome < 0) {
+			failed++;
+			continue;
+		}
+		outcomes[result->outcome]++;
+		if (result->outcome != SIM_COMPLETED)
+			continue;
+		makespans[completed++] = result->makespan;
+		makespan_sum += result->makespan;
+		wait += result->average_wait;
+		utilization += result->utilization;
+		if (result->utilization < min_util)
+			min_util = result->utilization;
+		if (result->utilization > max_util)
+			max_util = result->utilization;
+	}
+	for (i = 0; i < sweep->num_workers; i++) {
+		steals += sweep->workers[i].steals;
+	}
+
+	printf("%d runs of %d processes over %d resource types, seed %lu, "
+		   "%s policy, %d threads\n", spec->runs, spec->processes,
+		   spec->num_types, spec->seed,
+		   spec->policy != NULL ? spec->policy->name : "input",
+		   sweep->num_workers);
+	printf("completed   %6d (%.1f%%)\n", outcomes[SIM_COMPLETED],
+		   100.0 * outcomes[SIM_COMPLETED] / spec->runs);
+	printf("deadlocked  %6d (%.1f%%)\n", outcomes[SIM_DEADLOCK],
+		   100.0 * outcomes[SIM_DEADLOCK] / spec->runs);
+	printf("stuck       %6d (%.1f%%)\n", outcomes[SIM_STUCK],
+		   100.0 * outcomes[SIM_STUCK] / spec->runs);
+	if (failed > 0)
+		printf("not run     %6d (out of memory)\n", failed);
+	if (completed > 0 && makespans != NULL) {
+		qsort(makespans, completed, sizeof(long), compare_long);
+		printf("makespan    mean %.1f  min %ld  p50 %ld  p95 %ld  max %ld\n",
+			   makespan_sum / completed, makespans[0],
+			   makespans[completed / 2], makespans[completed * 95 / 100],
+			   makespans[completed - 1]);
+		printf("wait        mean %.2f per process\n", wait / completed);
+		printf("utilization mean %.1f%%  min %.1f%%  max %.1f%%\n",
+			   100 * utilization / completed, 100 * min_util,
+			   100 * max_util);
+	}
+	printf("%.3fs, %.0f runs/s, %d steals\n", seconds,
+		   spec->runs / seconds, steals);
+	free(makespans);
+}
+
+static int compare_long(const void *a, const void *b) {
+	long x = *(const long *) a;
+	long y = *(const long *) b;
+	return x < y ? -1 : x > y;
+}
+
+static int parse_spec(spec_t *spec, const char *text) {
+	char *copy = strdup(text);
+	char *item, *save;
+	const char *given;
+	int result = 0;
+
+	spec->runs = 1000;
+	spec->seed = 1;
+	spec->processes = 20;
+	spec->num_types = 3;
+	spec->total[0] = spec->total[1] = spec->total[2] = 10;
+	spec->arrival.kind = DIST_EXP;
+	spec->arrival.a = 2;
+	spec->duration.kind = DIST_UNIFORM;
+	spec->duration.a = 1;
+	spec->duration.b = 20;
+	spec->demand.kind = DIST_UNIFORM;
+	spec->demand.a = 0;
+	spec->demand.b = 1;
+	spec->requests = 1;
+	if (copy == NULL)
+		return -1;
+
+	for (item = strtok_r(copy, ",", &save); item != NULL && result == 0;
+		 item = strtok_r(NULL, ",", &save)) {
+		char *value = strchr(item, '=');
+		if (value == NULL) {
+			fprintf(stderr, "Invalid sweep setting %s\n", item);
+			result = -1;
+			break;
+		}
+		*value++ = '\0';
+		given = value;
+		if (strcmp(item, "runs") == 0) {
+			spec->runs = atoi(value);
+			result = spec->runs > 0 ? 0 : -1;
+		} else if (strcmp(item, "seed") == 0) {
+			spec->seed = strtoul(value, NULL, 10);
+		} else if (strcmp(item, "processes") == 0) {
+			spec->processes = atoi(value);
+			result = spec->processes > 0 ? 0 : -1;
+		} else if (strcmp(item, "resources") == 0) {
+			char *end;
+			spec->num_types = 0;
+			do {
+				if (spec->num_types == MAX_TYPES) {
+					result = -1;
+					break;
+				}
+				spec->total[spec->num_types] = strtol(value, &end, 10);
+				if (end == value || spec->total[spec->num_types] < 0)
+					result = -1;
+				spec->num_types++;
+				value = end + 1;
+			} while (*end == ':');
+			if (*end != '\0')
+				result = -1;
+		} else if (strcmp(item, "arrival") == 0) {
+			result = parse_dist(&spec->arrival, value);
+		} else if (strcmp(item, "duration") == 0) {
+			result = parse_dist(&spec->duration, value);
+		} else if (strcmp(item, "demand") == 0) {
+			result = parse_dist(&spec->demand, value);
+		} else if (strcmp(item, "policy") == 0) {
+			spec->policy = find_policy(value);
+			result = spec->policy != NULL ? 0 : -1;
+		} else if (strcmp(item, "requests") == 0) {
+			spec->requests = atoi(value);
+			result = spec->requests > 0 ? 0 : -1;
+		} else {
+			result = -1;
+		}
+		if (result != 0)
+			fprintf(stderr, "Invalid sweep setting %s=%s\n", item, given);
+	}
+	free(copy);
+	return result;
+}
+
+/* "const:v", "uniform:lo:hi", "exp:mean" or "normal:mean:sd" */
+static int parse_dist(dist_t *dist, const char *text) {
+	if (sscanf(text, "const:%lf", &dist->a) == 1) {
+		dist->kind = DIST_CONST;
+	} else if (sscanf(text, "uniform:%lf:%lf", &dist->a, &dist->b) == 2) {
+		dist->kind = DIST_UNIFORM;
+	} else if (sscanf(text, "exp:%lf", &dist->a) == 1) {
+		dist->kind = DIST_EXP;
+	} else if (sscanf(text, "normal:%lf:%lf", &dist->a, &dist->b) == 2) {
+		dist->kind = DIST_NORMAL;
+	} else {
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,9 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+/* Monte-Carlo runs of the simulation over random scenarios, spread
+   over threads. The spec is a comma-separated list of key=value
+   settings; see sweep.c. Returns -1 if the spec is invalid. */
+int run_sweep(const char *spec, int threads);
+
+#endif
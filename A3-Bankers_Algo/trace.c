@@ -0,0 +1,273 @@
+#include <stdlib.h>
+#include <string.h>
+#include "simulation.h"
+#include "trace.h"
+
+#define TRACE_BUFFER_SIZE 65536
+
+static const char *kind_names[] = {
+	"tick", "arrived", "requested", "finished", "running", "granted",
+	"waiting", "started", "idle", "system_idle", "completed", "deadlock",
+	"stuck", "quiet"
+};
+
+/* The original output of each kind of record. Those about a process
+   go around its name. */
+static const char *text_before[] = {
+	"\n?> Simulation time: ", "?> Process ", "?> Process ", "?> Process ",
+	"?> Process ", "?> Process ", "?> Process ", "?> Process ",
+	"?> Process ",
+	"?> No processes running. System is idle\n",
+	"?> No processes available for execution\n\n?> Simulation is ended.\n",
+	"?> No process is running. Available resources are not sufficient to "
+	"run any idle process or to avoid deadlocks. Aborting\n\n"
+	"?> Simulation is ended\n",
+	"?> No process can make progress. Aborting\n\n"
+	"?> Simulation is ended\n",
+	""
+};
+static const char *text_after[] = {
+	"\n", " has just arrived at the system\n",
+	" has requested more resources\n", " has just finished execution\n",
+	" is running\n", " was granted more resources\n",
+	" is waiting for resources\n", " has just started execution\n",
+	" is idle\n", "", "", "", "", ""
+};
+
+static void write_text(trace_t *trace, int kind, long time, int process);
+static void write_csv(trace_t *trace, int kind, long time, long until,
+					  int process);
+static void write_jsonl(trace_t *trace, int kind, long time, long until,
+						int process);
+static void put(trace_t *trace, const char *data, size_t n);
+static void put_string(trace_t *trace, const char *s);
+static void put_long(trace_t *trace, long value);
+static void flush(trace_t *trace);
+
+/* The format called name, or -1 if there isn't one */
+int trace_format(const char *name) {
+	if (strcmp(name, "text") == 0)
+		return TRACE_TEXT;
+	if (strcmp(name, "csv") == 0)
+		return TRACE_CSV;
+	if (strcmp(name, "jsonl") == 0)
+		return TRACE_JSONL;
+	if (strcmp(name, "binary") == 0)
+		return TRACE_BINARY;
+	return -1;
+}
+
+/* Start a trace of sim's run in the given format. Returns -1 if out of
+   memory. */
+int trace_open(trace_t *trace, int format, FILE *out, simulation_t *sim) {
+	memset(trace, 0, sizeof(*trace));
+	trace->format = format;
+	trace->out = out;
+	trace->sim = sim;
+	trace->size = TRACE_BUFFER_SIZE;
+	trace->buffer = malloc(trace->size);
+	if (trace->buffer == NULL)
+		return -1;
+	if (format == TRACE_CSV)
+		put_string(trace, "time,event,process,until\n");
+	return 0;
+}
+
+/* Record something that happened at time, to process or, if process is
+   -1, to the whole system */
+void trace_event(trace_t *trace, int kind, long time, int process) {
+	trace_record_t record;
+
+	switch (trace->format) {
+	case TRACE_TEXT:
+		write_text(trace, kind, time, process);
+		break;
+	case TRACE_CSV:
+		if (kind != TRACE_TICK)
+			write_csv(trace, kind, time, 0, process);
+		break;
+	case TRACE_JSONL:
+		if (kind != TRACE_TICK)
+			write_jsonl(trace, kind, time, 0, process);
+		break;
+	case TRACE_BINARY:
+		if (kind == TRACE_TICK)
+			break;
+		memset(&record, 0, sizeof(record));
+		record.time = time;
+		record.kind = kind;
+		record.process = process;
+		put(trace, (char *) &record, sizeof(record));
+		break;
+	}
+}
+
+/* Start a quiet span of the time steps from first up to until. The
+   records that follow, up to trace_quiet_end, hold for all of them. */
+void trace_quiet(trace_t *trace, long first, long until) {
+	trace_record_t record;
+
+	switch (trace->format) {
+	case TRACE_TEXT:
+		trace->in_quiet = 1;
+		trace->quiet_first = first;
+		trace->quiet_until = until;
+		trace->block_used = 0;
+		break;
+	case TRACE_CSV:
+		write_csv(trace, TRACE_QUIET, first, until, -1);
+		break;
+	case TRACE_JSONL:
+		write_jsonl(trace, TRACE_QUIET, first, until, -1);
+		break;
+	case TRACE_BINARY:
+		memset(&record, 0, sizeof(record));
+		record.time = first;
+		record.until = until;
+		record.kind = TRACE_QUIET;
+		record.process = -1;
+		put(trace, (char *) &record, sizeof(record));
+		break;
+	}
+}
+
+/* For text, print the lines collected since trace_quiet once for each
+   step of the span */
+void trace_quiet_end(trace_t *trace) {
+	long time;
+
+	if (!trace->in_quiet)
+		return;
+	trace->in_quiet = 0;
+	for (time = trace->quiet_first; time < trace->quiet_until; time++) {
+		write_text(trace, TRACE_TICK, time, -1);
+		put(trace, trace->block, trace->block_used);
+	}
+}
+
+void trace_close(trace_t *trace) {
+	flush(trace);
+	fflush(trace->out);
+	free(trace->buffer);
+	free(trace->block);
+	trace->buffer = NULL;
+	trace->block = NULL;
+}
+
+static void write_text(trace_t *trace, int kind, long time, int process) {
+	put_string(trace, text_before[kind]);
+	if (kind == TRACE_TICK)
+		put_long(trace, time);
+	else if (process != -1)
+		put_string(trace, trace->sim->processes[process].name);
+	put_string(trace, text_after[kind]);
+}
+
+static void write_csv(trace_t *trace, int kind, long time, long until,
+					  int process) {
+	put_long(trace, time);
+	put(trace, ",", 1);
+	put_string(trace, kind_names[kind]);
+	put(trace, ",", 1);
+	if (process != -1) {
+		const char *name = trace->sim->processes[process].name;
+		if (strpbrk(name, ",\"") == NULL) {
+			put_string(trace, name);
+		} else {
+			/* Quoted, with quotes doubled */
+			put(trace, "\"", 1);
+			for (; *name != '\0'; name++) {
+				put(trace, name, 1);
+				if (*name == '"')
+					put(trace, "\"", 1);
+			}
+			put(trace, "\"", 1);
+		}
+	}
+	put(trace, ",", 1);
+	if (kind == TRACE_QUIET)
+		put_long(trace, until);
+	put(trace, "\n", 1);
+}
+
+static void write_jsonl(trace_t *trace, int kind, long time, long until,
+						int process) {
+	put_string(trace, "{\"time\":");
+	put_long(trace, time);
+	put_string(trace, ",\"event\":\"");
+	put_string(trace, kind_names[kind]);
+	put(trace, "\"", 1);
+	if (process != -1) {
+		const char *name = trace->sim->processes[process].name;
+		put_string(trace, ",\"process\":\"");
+		for (; *name != '\0'; name++) {
+			if (*name == '"' || *name == '\\') {
+				put(trace, "\\", 1);
+				put(trace, name, 1);
+			} else if ((unsigned char) *name < 0x20) {
+				char escape[8];
+				snprintf(escape, sizeof(escape), "\\u%04x", *name);
+				put_string(trace, escape);
+			} else {
+				put(trace, name, 1);
+			}
+		}
+		put(trace, "\"", 1);
+	}
+	if (kind == TRACE_QUIET) {
+		put_string(trace, ",\"until\":");
+		put_long(trace, until);
+	}
+	put_string(trace, "}\n");
+}
+
+/* Append to the output, or to the quiet span's block while collecting
+   one */
+static void put(trace_t *trace, const char *data, size_t n) {
+	if (trace->in_quiet) {
+		if (trace->block_used + n > trace->block_size) {
+			size_t size = trace->block_size * 2 + n + 256;
+			char *block = realloc(trace->block, size);
+			if (block == NULL)
+				return;
+			trace->block = block;
+			trace->block_size = size;
+		}
+		memcpy(trace->block + trace->block_used, data, n);
+		trace->block_used += n;
+		return;
+	}
+	if (trace->used + n > trace->size) {
+		flush(trace);
+		if (n > trace->size) {
+			fwrite(data, 1, n, trace->out);
+			return;
+		}
+	}
+	memcpy(trace->buffer + trace->used, data, n);
+	trace->used += n;
+}
+
+static void put_string(trace_t *trace, const char *s) {
+	put(trace, s, strlen(s));
+}
+
+static void put_long(trace_t *trace, long value) {
+	char digits[24];
+	char *pos = digits + sizeof(digits);
+	unsigned long magnitude = value < 0 ? -(unsigned long) value : value;
+
+	do {
+		*--pos = '0' + magnitude % 10;
+		magnitude /= 10;
+	} while (magnitude > 0);
+	if (value < 0)
+		*--pos = '-';
+	put(trace, pos, digits + sizeof(digits) - pos);
+}
+
+static void flush(trace_t *trace) {
+	if (trace->used > 0)
+		fwrite(trace->buffer, 1, trace->used, trace->out);
+	trace->used = 0;
+}
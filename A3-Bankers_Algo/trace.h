@@ -0,0 +1,70 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+
+struct simulation_t;
+
+/* What the simulation reports, one record per process per time step
+ * plus a few for the whole system. A formatter turns the records into
+ * the original text, CSV, JSON lines or fixed-size binary records, all
+ * written through one buffer.
+ *
+ * Time steps in which nothing happens are reported once, as a quiet
+ * span from its first step up to but not including until, followed by
+ * the state of each process during it.
+ */
+#define TRACE_TICK 0		/* a time step starts */
+#define TRACE_ARRIVED 1
+#define TRACE_REQUESTED 2	/* asks for more resources */
+#define TRACE_FINISHED 3
+#define TRACE_RUNNING 4
+#define TRACE_GRANTED 5
+#define TRACE_WAITING 6
+#define TRACE_STARTED 7
+#define TRACE_IDLE 8
+#define TRACE_SYSTEM_IDLE 9	/* nothing running */
+#define TRACE_COMPLETED 10	/* the end: everything finished */
+#define TRACE_DEADLOCK 11	/* the end: nothing could start */
+#define TRACE_STUCK 12		/* the end: only waiting processes left */
+#define TRACE_QUIET 13		/* a quiet span starts */
+
+#define TRACE_TEXT 0
+#define TRACE_CSV 1
+#define TRACE_JSONL 2
+#define TRACE_BINARY 3
+
+/* A record of the binary format */
+typedef struct trace_record_t {
+	long long time;
+	long long until;	/* end of a quiet span, else 0 */
+	int kind;
+	int process;		/* -1 for the whole system */
+} trace_record_t;
+
+typedef struct trace_t {
+	int format;
+	FILE *out;
+	struct simulation_t *sim;	/* for process names */
+	char *buffer;
+	size_t used;
+	size_t size;
+	/* The lines of a quiet span, when writing text, to be repeated for
+	   each of its time steps */
+	int in_quiet;
+	long quiet_first;
+	long quiet_until;
+	char *block;
+	size_t block_used;
+	size_t block_size;
+} trace_t;
+
+int trace_format(const char *name);
+int trace_open(trace_t *trace, int format, FILE *out,
+			   struct simulation_t *sim);
+void trace_event(trace_t *trace, int kind, long time, int process);
+void trace_quiet(trace_t *trace, long first, long until);
+void trace_quiet_end(trace_t *trace);
+void trace_close(trace_t *trace);
+
+#endif
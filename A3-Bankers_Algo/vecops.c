@@ -0,0 +1,79 @@
+#include "vecops.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define LANES 8
+typedef __m256i vec_t;
+#define LOAD(p) _mm256_loadu_si256((const __m256i *) (p))
+#define STORE(p, v) _mm256_storeu_si256((__m256i *) (p), (v))
+#define ADD(a, b) _mm256_add_epi32((a), (b))
+#define SUB(a, b) _mm256_sub_epi32((a), (b))
+#define ANY_GT(a, b) _mm256_movemask_epi8(_mm256_cmpgt_epi32((a), (b)))
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define LANES 4
+typedef __m128i vec_t;
+#define LOAD(p) _mm_loadu_si128((const __m128i *) (p))
+#define STORE(p, v) _mm_storeu_si128((__m128i *) (p), (v))
+#define ADD(a, b) _mm_add_epi32((a), (b))
+#define SUB(a, b) _mm_sub_epi32((a), (b))
+#define ANY_GT(a, b) _mm_movemask_epi8(_mm_cmpgt_epi32((a), (b)))
+#endif
+
+/* Whether a[i] <= b[i] for every i */
+int vec_le(const int *a, const int *b, int n) {
+	int i = 0;
+#ifdef LANES
+	for (; i + LANES <= n; i += LANES) {
+		if (ANY_GT(LOAD(a + i), LOAD(b + i)))
+			return 0;
+	}
+#endif
+	for (; i < n; i++) {
+		if (a[i] > b[i])
+			return 0;
+	}
+	return 1;
+}
+
+/* dst += src */
+void vec_add(int *dst, const int *src, int n) {
+	int i = 0;
+#ifdef LANES
+	for (; i + LANES <= n; i += LANES) {
+		STORE(dst + i, ADD(LOAD(dst + i), LOAD(src + i)));
+	}
+#endif
+	for (; i < n; i++) {
+		dst[i] += src[i];
+	}
+}
+
+/* dst -= src */
+void vec_sub(int *dst, const int *src, int n) {
+	int i = 0;
+#ifdef LANES
+	for (; i + LANES <= n; i += LANES) {
+		STORE(dst + i, SUB(LOAD(dst + i), LOAD(src + i)));
+	}
+#endif
+	for (; i < n; i++) {
+		dst[i] -= src[i];
+	}
+}
+
+/* from -= amount, to += amount, in one pass */
+void vec_move(int *from, int *to, const int *amount, int n) {
+	int i = 0;
+#ifdef LANES
+	for (; i + LANES <= n; i += LANES) {
+		vec_t v = LOAD(amount + i);
+		STORE(from + i, SUB(LOAD(from + i), v));
+		STORE(to + i, ADD(LOAD(to + i), v));
+	}
+#endif
+	for (; i < n; i++) {
+		from[i] -= amount[i];
+		to[i] += amount[i];
+	}
+}
@@ -0,0 +1,12 @@
+#ifndef VECOPS_H
+#define VECOPS_H
+
+/* Whole-row operations on resource vectors of n ints. They use AVX2 or
+   SSE2 when the compiler targets them, and plain loops otherwise. */
+
+int vec_le(const int *a, const int *b, int n);
+void vec_add(int *dst, const int *src, int n);
+void vec_sub(int *dst, const int *src, int n);
+void vec_move(int *from, int *to, const int *amount, int n);
+
+#endif